@@ -11,6 +11,9 @@ extern const unsigned long classRomSize;
 extern unsigned char *classRom_ext;
 extern unsigned long classRomSize_ext;
 
+// the sizes in the ROM image are 32 bit, also where long is 64 bits
+#define ROM_SIZE_LEN	4
+
 #define CLASS_FILES
 
 #ifdef CLASS_FILES
@@ -22,6 +25,8 @@ static long file_read(const char *p_fname, unsigned char **pp_bin, long *p_size)
 	long fsize;
 	char path[255];
 
+	if (strlen(baseClassDir) + 1 + strlen(p_fname) + sizeof(".class") > sizeof(path))
+		return FT_ERR_NOTFOUND;
 	strcpy(path, baseClassDir);
 	strcat(path, "/");
 	strcat(path, p_fname);
@@ -80,11 +85,11 @@ static unsigned char* loadClassCode(const char* className)
 		ptr = (unsigned char*)classRom_ext;
 		while ((unsigned long)(ptr - classRom_ext) < classRomSize_ext) {
 			allSize = utils_get_uint32b(ptr);
-			ptr += sizeof(unsigned long);
+			ptr += ROM_SIZE_LEN;
 			nameSize = utils_get_uint16b(ptr);
 			ptr += sizeof(unsigned short);
 			if ((strlen(className) == nameSize) && (strncmp(className, (const char*)ptr, nameSize) == 0))
-				return ptr + nameSize + sizeof(unsigned long);
+				return ptr + nameSize + ROM_SIZE_LEN;
 			ptr += allSize - sizeof(unsigned short);
 		}
 	}
@@ -104,11 +109,11 @@ unsigned char *getClassCode( const char *className ){
 	ptr = (unsigned char*)classRom;
 	while( (unsigned long)( ptr - classRom ) < classRomSize ){
 		allSize = utils_get_uint32b( ptr );
-		ptr += sizeof( unsigned long );
+		ptr += ROM_SIZE_LEN;
 		nameSize = utils_get_uint16b( ptr );
 		ptr += sizeof(unsigned short);
 		if( ( strlen( className ) == nameSize ) && ( strncmp( className, (const char*)ptr, nameSize ) == 0 ) )
-			return ptr + nameSize + sizeof(unsigned long);
+			return ptr + nameSize + ROM_SIZE_LEN;
 		ptr += allSize - sizeof(unsigned short);
 	}
 
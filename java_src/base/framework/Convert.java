@@ -5,4 +5,7 @@ public class Convert {
 	public native static String toString(boolean b);
 	public native static String toString(char c);
 	public native static String toString(int i);
+	public native static String toString(long l);
+	public native static String toString(float f);
+	public native static String toString(double d);
 }
\ No newline at end of file
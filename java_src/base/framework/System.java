@@ -4,6 +4,46 @@ public class System {
 	public native static void arraycopy( Object src, int srcOff, Object dest, int destOff, int length );
 
 	public native static final void gc();
+
+	// GC statistics. getGcTotals() fills in the counters since the VM
+	// started, getGcHistory() GC_RECORD_SIZE values for each of the
+	// recent collections (the last one first). They return the number
+	// of values and records filled in. Times are in microseconds.
+	public static final int GC_TOTAL_GCS = 0;
+	public static final int GC_TOTAL_COMPACTIONS = 1;
+	public static final int GC_TOTAL_RESIZES = 2;
+	public static final int GC_TOTAL_PAUSE_TIME = 3;
+	public static final int GC_TOTAL_MAX_PAUSE_TIME = 4;
+	public static final int GC_TOTAL_BYTES_ALLOCATED = 5;
+	public static final int GC_TOTAL_OBJECTS_ALLOCATED = 6;
+	public static final int GC_TOTAL_BYTES_FREED = 7;
+	public static final int GC_TOTAL_OBJECTS_FREED = 8;
+	public static final int GC_TOTAL_BYTES_MOVED = 9;
+	public static final int GC_TOTALS_SIZE = 10;
+
+	public static final int GC_RECORD_REASON = 0;
+	public static final int GC_RECORD_HEAP_SIZE = 1;
+	public static final int GC_RECORD_MARK_TIME = 2;
+	public static final int GC_RECORD_SWEEP_TIME = 3;
+	public static final int GC_RECORD_COMPACT_TIME = 4;
+	public static final int GC_RECORD_BYTES_MOVED = 5;
+	public static final int GC_RECORD_OBJECTS_FREED = 6;
+	public static final int GC_RECORD_BYTES_FREED = 7;
+	public static final int GC_RECORD_LIVE_HANDLES = 8;
+	public static final int GC_RECORD_FREE_HANDLES = 9;
+	public static final int GC_RECORD_SIZE = 10;
+
+	public static final int GC_REASON_ALLOC = 0;
+	public static final int GC_REASON_LARGE = 1;
+	public static final int GC_REASON_EXPLICIT = 2;
+
+	public native static final int getGcTotals( int[] totals );
+	public native static final int getGcHistory( int[] records );
+
+	// print the objects in the heap by class, or write them all with the
+	// references between them to the file the host chose (false if none)
+	public native static final void printHeapHistogram();
+	public native static final boolean dumpHeap();
 	public native static final Object newInstance( String className );
 
 	public native static final String getClassName( Object obj );
@@ -14,6 +54,23 @@ public class System {
 	public native static final String[] getInput(int max);
 	public native static final void setOutput(String[] output);
 
+	// binary input and output given by the host. readInput() copies up to
+	// len bytes from position pos of the input and returns their number,
+	// or -1 at the end. writeOutput() appends to the output and returns the
+	// number of bytes written, less than len when the output is full.
+	public native static final int getInputSize();
+	public native static final int readInput(int pos, byte[] buf, int off, int len);
+	public native static final int writeOutput(byte[] buf, int off, int len);
+
+	// input and output streams the host feeds and drains while the VM
+	// runs. readStream() returns the bytes read, 0 if none are there yet
+	// or -1 at the end. writeStream() returns the bytes written, less than
+	// len when the host doesn't take the output. flushStream() hands the
+	// output written so far to the host.
+	public native static final int readStream(byte[] buf, int off, int len);
+	public native static final int writeStream(byte[] buf, int off, int len);
+	public native static final void flushStream();
+
 	public native static void printStackTrace();
 	public native static void print( String s );
 
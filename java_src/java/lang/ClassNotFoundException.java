@@ -0,0 +1,11 @@
+package java.lang;
+
+public class ClassNotFoundException extends Exception {
+  public ClassNotFoundException() {
+    super();
+  }
+
+  public ClassNotFoundException( String message ) {
+    super( message );
+  }
+}
\ No newline at end of file
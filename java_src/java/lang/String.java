@@ -4,35 +4,34 @@ import base.framework.System;
 import base.framework.Convert;
 
 public class String {
-  char chars[];
+  // When set, strings whose characters all fit in Latin-1 keep one byte
+  // per character. This must match COMPACT_STRINGS in the VM.
+  static final boolean COMPACT_STRINGS = true;
+  static final byte LATIN1 = 0;
+  static final byte UTF16 = 1;
+
+  // The characters, one byte each if coder is LATIN1 or two bytes each
+  // (low byte first) if coder is UTF16. The VM natives read these two
+  // fields directly so they must stay the first fields of the class.
+  byte value[];
+  byte coder;
 
   /** Creates an empty string. */
   public String() {
-    chars = new char[0];
+    value = new byte[0];
+    coder = COMPACT_STRINGS ? LATIN1 : UTF16;
   }
 
-  /**
-   * Creates a string from an array of strings. This method is declared protected and
-   * for internal use only. The StringBuffer class should be used to create a string
-   * from an array of strings.
-   */
-  protected String(String s[], int count) {
-    int len = 0;
-    for (int i = 0; i < count; i++)
-      len += s[i].chars.length;
-    char c[] = new char[len];
-    int j = 0;
-    for (int i = 0; i < count; i++) {
-      int slen = s[i].chars.length;
-      System.arraycopy(s[i].chars, 0, c, j, slen);
-      j += slen;
-    }
-    chars = c;
+  // takes the given value without copying it
+  String(byte v[], byte c) {
+    value = v;
+    coder = c;
   }
 
   /** Creates a copy of the given string. */
   public String(String s) {
-    chars = s.chars;
+    value = s.value;
+    coder = s.coder;
   }
 
   /** Creates a string from the given character array. */
@@ -47,15 +46,37 @@ public class String {
    * @param count the number of characters
    */
   public String(char c[], int offset, int count) {
-    char chars[] = new char[count];
-    System.arraycopy(c, offset, chars, 0, count);
-    this.chars = chars;
+    int i = 0;
+    if (COMPACT_STRINGS)
+      while (i < count && c[offset + i] <= 0xFF)
+        i++;
+    if (COMPACT_STRINGS && i == count) {
+      value = new byte[count];
+      for (i = 0; i < count; i++)
+        value[i] = (byte)c[offset + i];
+      coder = LATIN1;
+    } else {
+      value = new byte[count * 2];
+      for (i = 0; i < count; i++) {
+        value[i * 2] = (byte)c[offset + i];
+        value[i * 2 + 1] = (byte)(c[offset + i] >> 8);
+      }
+      coder = UTF16;
+    }
   }
 
+  /** Creates a string of the given Latin-1 bytes. */
   public String(byte b[], int offset, int count) {
-    this.chars = new char[count];
-    for( int i = 0 ; i < count ; i++ )
-      this.chars[i] = (char)( b[ offset + i ] & 0x00ff );
+    if (COMPACT_STRINGS) {
+      value = new byte[count];
+      System.arraycopy(b, offset, value, 0, count);
+      coder = LATIN1;
+    } else {
+      value = new byte[count * 2];
+      for (int i = 0; i < count; i++)
+        value[i * 2] = b[offset + i];
+      coder = UTF16;
+    }
   }
 
   public String(byte b[]) {
@@ -64,37 +85,42 @@ public class String {
 
   /** Returns the length of the string in characters. */
   public int length() {
-    return chars.length;
+    return value.length >> coder;
   }
 
   /** Returns the character at the given position. */
   public char charAt(int i) {
-    return chars[i];
+    if (coder == LATIN1)
+      return (char)(value[i] & 0xff);
+    return (char)((value[i * 2] & 0xff) | ((value[i * 2 + 1] & 0xff) << 8));
   }
 
   /** Concatenates the given string to this string and returns the result. */
   public String concat(String s) {
-    if (s == null || s.chars.length == 0)
+    if (s == null || s.value.length == 0)
       return this;
     return this +s;
   }
 
   /**
    * Returns this string as a character array. The array returned is
-   * allocated by this method and is a copy of the string's internal character
-   * array.
+   * allocated by this method.
    */
   public char[] toCharArray() {
     int length = length();
     char chars[] = new char[length];
-    System.arraycopy(this.chars, 0, chars, 0, length);
+    for (int i = 0; i < length; i++)
+      chars[i] = charAt(i);
     return chars;
   }
 
   public byte[] getBytes(){
     byte[] bytes = new byte[ length() ];
-    for( int i = 0 ; i < bytes.length; i++ )
-      bytes[i] = (byte)chars[i];
+    if( coder == LATIN1 )
+      System.arraycopy( value, 0, bytes, 0, bytes.length );
+    else
+      for( int i = 0 ; i < bytes.length; i++ )
+        bytes[i] = value[i * 2];
     return bytes;
   }
 
@@ -135,7 +161,7 @@ public class String {
     if( fromIndex < 0 )
       fromIndex = 0;
     for( int i = fromIndex ; i < length() ; i++ )
-      if( chars[i] == (char)ch )
+      if( charAt(i) == (char)ch )
         return i;
     return -1;
   }
@@ -150,7 +176,7 @@ public class String {
     if( fromIndex < 0 )
       fromIndex = 0;
     for( int i = length() - 1 ; i >= fromIndex ; i-- )
-      if( chars[i] == (char)ch )
+      if( charAt(i) == (char)ch )
         return i;
     return -1;
   }
@@ -164,7 +190,7 @@ public class String {
       return false;
     int start = length() - prefix.length();
     for( int i = 0; i < prefix.length(); i++ )
-      if( chars[ start + i ] != prefix.chars[ i ] )
+      if( charAt( start + i ) != prefix.charAt( i ) )
         return false;
     return true;
   }
@@ -173,7 +199,7 @@ public class String {
     if( toffset + prefix.length() > length() )
       return false;
     for( int i = 0 ; i < prefix.length(); i++ )
-      if( chars[ toffset + i ] != prefix.chars[ i ] )
+      if( charAt( toffset + i ) != prefix.charAt( i ) )
         return false;
     return true;
   }
@@ -193,7 +219,9 @@ public class String {
    * @param end the character after the last character of the substring
    */
   public String substring(int start, int end) {
-    return new String(chars, start, end - start);
+    byte v[] = new byte[(end - start) << coder];
+    System.arraycopy(value, start << coder, v, 0, v.length);
+    return new String(v, coder);
   }
 
   public String substring( int start ){
@@ -207,11 +235,20 @@ public class String {
   public boolean equals(Object obj) {
     if (obj instanceof String) {
       String s = (String) obj;
-      if (chars.length != s.chars.length)
-        return false;
-      for (int i = 0; i < chars.length; i++)
-        if (chars[i] != s.chars[i])
+      if (coder == s.coder) {
+        if (value.length != s.value.length)
+          return false;
+        for (int i = 0; i < value.length; i++)
+          if (value[i] != s.value[i])
+            return false;
+      } else {
+        // a substring of a UTF16 string may only have Latin-1 characters
+        if (length() != s.length())
           return false;
+        for (int i = 0; i < length(); i++)
+          if (charAt(i) != s.charAt(i))
+            return false;
+      }
     }else
       return false;
     return true;
@@ -219,7 +256,7 @@ public class String {
 
   public int compareTo( String anotherString ){
     for( int i = 0 ; i < anotherString.length() && i < this.length() ; i++ )
-      if( anotherString.chars[i] != this.chars[i] )
+      if( anotherString.charAt(i) != this.charAt(i) )
         return -1;
     if( anotherString.length() == this.length() )
       return 0;
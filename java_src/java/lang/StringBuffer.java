@@ -1,17 +1,20 @@
 package java.lang;
 
-import base.framework.Convert;
-
 public class StringBuffer {
-  String strings[] = new String[4];
+  // the characters are kept like String.value, the natives read these
+  // variables directly
+  byte value[];
   int count = 0;
+  byte coder = String.COMPACT_STRINGS ? String.LATIN1 : String.UTF16;
 
   /** Constructs an empty string buffer. */
   public StringBuffer() {
+    value = new byte[16 << coder];
   }
 
   /** Constructs a string buffer containing the given string. */
   public StringBuffer(String s) {
+    this();
     append(s);
   }
 
@@ -20,27 +23,42 @@ public class StringBuffer {
    * given boolean value.
    * @see waba.sys.Convert
    */
-  public StringBuffer append(boolean b) {
-    return append(Convert.toString(b));
-  }
+  public native StringBuffer append(boolean b);
 
   /**
    * Constructs a string buffer containing the string representation of the
    * given char value.
    * @see waba.sys.Convert
    */
-  public StringBuffer append(char c) {
-    return append(Convert.toString(c));
-  }
+  public native StringBuffer append(char c);
 
   /**
    * Constructs a string buffer containing the string representation of the
    * given int value.
    * @see waba.sys.Convert
    */
-  public StringBuffer append(int i) {
-    return append(Convert.toString(i));
-  }
+  public native StringBuffer append(int i);
+
+  /**
+   * Constructs a string buffer containing the string representation of the
+   * given long value.
+   * @see waba.sys.Convert
+   */
+  public native StringBuffer append(long l);
+
+  /**
+   * Constructs a string buffer containing the string representation of the
+   * given float value.
+   * @see waba.sys.Convert
+   */
+  public native StringBuffer append(float f);
+
+  /**
+   * Constructs a string buffer containing the string representation of the
+   * given double value.
+   * @see waba.sys.Convert
+   */
+  public native StringBuffer append(double d);
 
   /** Appends the given character array as a string to the string buffer. */
   public StringBuffer append(char c[]) {
@@ -48,17 +66,7 @@ public class StringBuffer {
   }
 
   /** Appends the given string to the string buffer. */
-  public StringBuffer append(String s) {
-    if (s == null)
-      return this;
-    if (strings.length == count) {
-      String newStrings[] = new String[strings.length * 2];
-      System.arraycopy(strings, 0, newStrings, 0, strings.length);
-      strings = newStrings;
-    }
-    strings[count++] = s;
-    return this;
-  }
+  public native StringBuffer append(String s);
 
   /** Appends the string representation of the given object to the string buffer. */
   public StringBuffer append(Object obj) {
@@ -72,21 +80,13 @@ public class StringBuffer {
    */
   public void setLength(int zero) {
     count = 0;
+    coder = String.COMPACT_STRINGS ? String.LATIN1 : String.UTF16;
   }
 
   public int length(){
-    int length = 0;
-    for( int i = 0 ; i < count; i++ ){
-      if (strings[i] == null)
-        return length;
-      else
-        length += strings[i].length();
-    }
-    return length;
+    return count;
   }
 
   /** Converts the string buffer to its string representation. */
-  public String toString() {
-    return new String(strings, count);
-  }
+  public native String toString();
 }
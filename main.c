@@ -1,14 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <emscripten/emscripten.h>
+#include "waba_stream.h"
+#include "waba_util.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 int EMSCRIPTEN_KEEPALIVE setInoutBuffer(const unsigned char *buffer, long bufferSize );
+int EMSCRIPTEN_KEEPALIVE setBinaryInput(const unsigned char *buffer, long bufferSize );
+int EMSCRIPTEN_KEEPALIVE setBinaryOutput(unsigned char *buffer, long bufferSize );
+long EMSCRIPTEN_KEEPALIVE getBinaryOutputLength(void);
+void EMSCRIPTEN_KEEPALIVE resetStreams(void);
+void EMSCRIPTEN_KEEPALIVE setStreamHook(StreamHook hook);
+long EMSCRIPTEN_KEEPALIVE pushInput(const unsigned char *data, long len);
+void EMSCRIPTEN_KEEPALIVE closeInput(void);
+long EMSCRIPTEN_KEEPALIVE pullOutput(unsigned char *data, long len);
 int EMSCRIPTEN_KEEPALIVE setRomImage(const unsigned char *romImage, long romSize );
 int EMSCRIPTEN_KEEPALIVE callStaticMain(char *className, char *param );
+int EMSCRIPTEN_KEEPALIVE callStaticMainBatch(char *className, char *params, long numParams, long *status, BatchHook hook );
 
 #ifdef __cplusplus
 }
@@ -16,7 +28,6 @@ int EMSCRIPTEN_KEEPALIVE callStaticMain(char *className, char *param );
 
 #include "utils.h"
 #include "waba.h"
-#include "waba_util.h"
 #include "debuglog.h"
 #include "mem_alloc.h"
 
@@ -24,6 +35,9 @@ int EMSCRIPTEN_KEEPALIVE callStaticMain(char *className, char *param );
 #define DEFAULT_NM_STACK_SIZE		1000
 #define DEFAULT_CLASS_HEAP_SIZE		20000
 #define DEFAULT_OBJECT_HEAP_SIZE	76000
+// growing needs the old and the new heap at once, 96000 is about what is
+// left of MEM_BLOCK_SIZE next to the initial heap, the stacks and classes
+#define DEFAULT_OBJECT_HEAP_MAX_SIZE	96000
 #define MEM_BLOCK_SIZE	(200*1024)
 unsigned char MemArray[MEM_BLOCK_SIZE];
 
@@ -33,6 +47,14 @@ unsigned long classRomSize_ext = 0;
 unsigned char *inoutBuff_ext = NULL;
 unsigned long inoutBuffSize_ext = 0;
 
+// binary input and output regions, read and written by Java with
+// System.readInput() and System.writeOutput()
+const unsigned char *binInput_ext = NULL;
+unsigned long binInputSize_ext = 0;
+unsigned char *binOutput_ext = NULL;
+unsigned long binOutputSize_ext = 0;
+unsigned long binOutputLength_ext = 0;
+
 int EMSCRIPTEN_KEEPALIVE setInoutBuffer(const unsigned char *buffer, long bufferSize )
 {
 	FUNC_CALL();
@@ -45,6 +67,70 @@ int EMSCRIPTEN_KEEPALIVE setInoutBuffer(const unsigned char *buffer, long buffer
 	return FT_ERR_OK;
 }
 
+int EMSCRIPTEN_KEEPALIVE setBinaryInput(const unsigned char *buffer, long bufferSize )
+{
+	FUNC_CALL();
+
+	binInput_ext = buffer;
+	binInputSize_ext = (buffer != NULL && bufferSize > 0) ? bufferSize : 0;
+
+	FUNC_RETURN();
+
+	return FT_ERR_OK;
+}
+
+int EMSCRIPTEN_KEEPALIVE setBinaryOutput(unsigned char *buffer, long bufferSize )
+{
+	FUNC_CALL();
+
+	binOutput_ext = buffer;
+	binOutputSize_ext = (buffer != NULL && bufferSize > 0) ? bufferSize : 0;
+	binOutputLength_ext = 0;
+
+	FUNC_RETURN();
+
+	return FT_ERR_OK;
+}
+
+// the number of bytes written to the binary output region
+long EMSCRIPTEN_KEEPALIVE getBinaryOutputLength(void)
+{
+	return (long)binOutputLength_ext;
+}
+
+// The streams can be used while callStaticMain() runs: the hook (a
+// function added with addFunction()) is called when Java needs input or
+// has output, and it can call pushInput() and pullOutput().
+
+void EMSCRIPTEN_KEEPALIVE resetStreams(void)
+{
+	VmStreamReset();
+}
+
+void EMSCRIPTEN_KEEPALIVE setStreamHook(StreamHook hook)
+{
+	VmStreamSetHook(hook);
+}
+
+long EMSCRIPTEN_KEEPALIVE pushInput(const unsigned char *data, long len)
+{
+	if (data == NULL || len <= 0)
+		return 0;
+	return (long)VmStreamPush(data, len);
+}
+
+void EMSCRIPTEN_KEEPALIVE closeInput(void)
+{
+	VmStreamCloseInput();
+}
+
+long EMSCRIPTEN_KEEPALIVE pullOutput(unsigned char *data, long len)
+{
+	if (data == NULL || len <= 0)
+		return 0;
+	return (long)VmStreamPull(data, len);
+}
+
 int EMSCRIPTEN_KEEPALIVE setRomImage(const unsigned char *romImage, long romSize )
 {
 	FUNC_CALL();
@@ -57,12 +143,8 @@ int EMSCRIPTEN_KEEPALIVE setRomImage(const unsigned char *romImage, long romSize
 	return FT_ERR_OK;
 }
 
-int EMSCRIPTEN_KEEPALIVE callStaticMain(char *className, char *param )
+static long initVm(void)
 {
-	FUNC_CALL();
-
-	debuglog("callStaticMain Called (className=%s)\n", className);
-
 	long ret;
 
 	ret = mem_initialize(MemArray, MEM_BLOCK_SIZE);
@@ -76,30 +158,29 @@ int EMSCRIPTEN_KEEPALIVE callStaticMain(char *className, char *param )
 	DEBUG_PRINT("DEFAULT_NM_STACK_SIZE = %d\n", DEFAULT_NM_STACK_SIZE);
 	DEBUG_PRINT("DEFAULT_CLASS_HEAP_SIZE = %d\n", DEFAULT_CLASS_HEAP_SIZE);
 	DEBUG_PRINT("DEFAULT_OBJECT_HEAP_SIZE = %d\n", DEFAULT_OBJECT_HEAP_SIZE);
+	DEBUG_PRINT("DEFAULT_OBJECT_HEAP_MAX_SIZE = %d\n", DEFAULT_OBJECT_HEAP_MAX_SIZE);
 
-	ret = VmInit(DEFAULT_VM_STACK_SIZE, DEFAULT_NM_STACK_SIZE, DEFAULT_CLASS_HEAP_SIZE, DEFAULT_OBJECT_HEAP_SIZE);
+	ret = VmInit(DEFAULT_VM_STACK_SIZE, DEFAULT_NM_STACK_SIZE, DEFAULT_CLASS_HEAP_SIZE, DEFAULT_OBJECT_HEAP_SIZE, DEFAULT_OBJECT_HEAP_MAX_SIZE);
 	if ( ret != FT_ERR_OK ){
 		debuglog("VmInit error\n");
 		mem_dispose();
 		return -1;
 	}
 
-	Var retVar;
-	unsigned char retType;
+	return FT_ERR_OK;
+}
 
-	ret = startStaticMain(className, param, &retType, &retVar);
-	if( ret != FT_ERR_OK || retType != RET_TYPE_NONE){
-		debuglog("return = %d\n", ret);
-		debuglog("retType=%d\n", retType);
-		debuglog("vmStatus.type=0x%x\n", vmStatus.type);
-		debuglog("vmStatus.errNum=0x%x\n", vmStatus.errNum);
-	}
+static long freeVm(void)
+{
+	long ret;
 
 	T_MEMINFO info;
 	ret = getMemInfo(&info);
 	if( ret == FT_ERR_OK ){
 		debuglog("totalObjectMem = %d\n", info.totalObjectMem);
+		debuglog("maxObjectMem = %d\n", info.maxObjectMem);
 		debuglog("unusedObjectMem = %d\n", info.unusedObjectMem);
+		debuglog("largeObjectMem = %d\n", info.largeObjectMem);
 		debuglog("totalClassMem = %d\n", info.totalClassMem);
 		debuglog("unusedClassMem = %d\n", info.unusedClassMem);
 		debuglog("MEM_BLOCK_SIZE = %d\n", MEM_BLOCK_SIZE);
@@ -110,7 +191,92 @@ int EMSCRIPTEN_KEEPALIVE callStaticMain(char *className, char *param )
 	
 	mem_dispose();
 
+	return ret;
+}
+
+int EMSCRIPTEN_KEEPALIVE callStaticMain(char *className, char *param )
+{
+	FUNC_CALL();
+
+	debuglog("callStaticMain Called (className=%s)\n", className);
+
+	long ret;
+
+	ret = initVm();
+	if ( ret != FT_ERR_OK )
+		return -1;
+
+	Var retVar;
+	unsigned char retType;
+
+	ret = startStaticMain(className, param, &retType, &retVar);
+	if( ret != FT_ERR_OK || retType != RET_TYPE_NONE){
+		debuglog("return = %d\n", ret);
+		debuglog("retType=%d\n", retType);
+		debuglog("vmStatus.type=0x%x\n", vmStatus.type);
+		debuglog("vmStatus.errNum=0x%x\n", vmStatus.errNum);
+	}
+
+	ret = freeVm();
+
 	FUNC_RETURN();
 	
 	return ret;
 }
+
+static BatchHook batchHook_ext = NULL;
+
+static void batchRecordDone(unsigned long index, long status, void *arg)
+{
+	if (batchHook_ext != NULL)
+		batchHook_ext(index, status, arg);
+	// the next record starts with an empty binary output
+	binOutputLength_ext = 0;
+}
+
+// run main once for each of the numParams NUL separated params in one
+// VM. The status of each record (BATCH_XXX) is put in status, the hook
+// is called after each record to take its output and to set up the
+// input of the next one.
+int EMSCRIPTEN_KEEPALIVE callStaticMainBatch(char *className, char *params, long numParams, long *status, BatchHook hook )
+{
+	FUNC_CALL();
+
+	debuglog("callStaticMainBatch Called (className=%s, numParams=%d)\n", className, numParams);
+
+	const char **paramList;
+	long i, ret;
+
+	if (numParams <= 0)
+		return FT_ERR_OK;
+	paramList = (const char **)malloc(sizeof(const char *) * numParams);
+	if (paramList == NULL)
+		return -1;
+	for (i = 0; i < numParams; i++) {
+		paramList[i] = params;
+		params += strlen(params) + 1;
+	}
+
+	ret = initVm();
+	if ( ret != FT_ERR_OK ){
+		free(paramList);
+		return -1;
+	}
+
+	batchHook_ext = hook;
+	binOutputLength_ext = 0;
+	ret = startStaticMainBatch(className, paramList, numParams, status, batchRecordDone, NULL);
+	batchHook_ext = NULL;
+	if( ret != FT_ERR_OK ){
+		debuglog("return = %d\n", ret);
+		debuglog("vmStatus.type=0x%x\n", vmStatus.type);
+		debuglog("vmStatus.errNum=0x%x\n", vmStatus.errNum);
+	}
+
+	freeVm();
+	free(paramList);
+
+	FUNC_RETURN();
+
+	return ret;
+}
@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "utils.h"
+#include "waba.h"
+#include "waba_util.h"
+#include "waba_stream.h"
+#include "waba_heap.h"
+#include "waba_heapdump.h"
+#include "alloc_class.h"
+#include "debuglog.h"
+#include "mem_alloc.h"
+
+// Native Linux runner, built with all the sources except main.c:
+//
+// gcc -O2 -o javaemu main_linux.c alloc_class.c debuglog.c maskrom.c mem_alloc.c
+//     utils.c waba.c waba_heap.c waba_heapdump.c waba_native.c waba_stream.c
+//     waba_utf.c waba_util.c -lm
+//
+// javaemu [options] <className> [param ...]    run main once
+// javaemu [options] -s                         serve requests on stdin/stdout
+// javaemu [options] -u <path>                  serve requests on a Unix socket
+//
+// -c <dir>   directory of the class files (pre_classes)
+// -r <file>  ROM image of classes, looked up before the class files
+// -i <file>  binary input (System.readInput)
+// -o <file>  binary output (System.writeOutput), stdout if not given
+// -d <file>  file System.dumpHeap() writes, it is off if not given
+//
+// In a run, stdin and stdout are the input and output streams
+// (System.readStream and System.writeStream). The params are the main
+// param and the strings of System.getInput().
+//
+// A server keeps the VM, so the classes are loaded and initialized once.
+// Each request runs main in it, the numbers are 32 bit big endian:
+//
+// request:  <length> <className> 0 <param> 0 <binary input>
+// response: <status (BATCH_XXX)> <length> <binary output>
+//
+// A request longer than MAX_REQUEST_SIZE or with a class name that isn't
+// a plain class name (see isValidClassName()) is answered with
+// BATCH_FAILED without running anything.
+//
+// The streams are not available to a server: the input stream is empty
+// (System.readStream returns -1) and the output stream goes to stderr.
+
+#define DEFAULT_VM_STACK_SIZE		2000
+#define DEFAULT_NM_STACK_SIZE		2000
+#define DEFAULT_CLASS_HEAP_SIZE		40000
+#define DEFAULT_OBJECT_HEAP_SIZE	32000
+#define DEFAULT_OBJECT_HEAP_MAX_SIZE	200000
+#define MEM_BLOCK_SIZE	(0x0000ffff << 3) // the most mem_initialize() takes
+#define INOUT_BUFFER_SIZE	4096
+#define OUTPUT_BUFFER_SIZE	(1024*1024)
+#define MAX_REQUEST_SIZE	(16*1024*1024)
+#define MAX_CLASS_NAME_LEN	126 // nativeLoadClass() has room for 127 bytes
+unsigned char MemArray[MEM_BLOCK_SIZE];
+
+unsigned char *classRom_ext = NULL;
+unsigned long classRomSize_ext = 0;
+
+unsigned char inoutBuff[INOUT_BUFFER_SIZE];
+unsigned char *inoutBuff_ext = inoutBuff;
+unsigned long inoutBuffSize_ext = sizeof(inoutBuff);
+
+const unsigned char *binInput_ext = NULL;
+unsigned long binInputSize_ext = 0;
+unsigned char *binOutput_ext = NULL;
+unsigned long binOutputSize_ext = 0;
+unsigned long binOutputLength_ext = 0;
+
+static int streamInFd = 0;
+static int streamOutFd = 1;
+
+static long writeAll(int fd, const unsigned char *data, unsigned long len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n <= 0)
+			return FT_ERR_FAILED;
+		data += n;
+		len -= n;
+	}
+	return FT_ERR_OK;
+}
+
+// read exactly len bytes, FT_ERR_NOTFOUND at the end of the input
+static long readAll(int fd, unsigned char *data, unsigned long len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, data, len);
+		if (n == 0)
+			return FT_ERR_NOTFOUND;
+		if (n < 0)
+			return FT_ERR_FAILED;
+		data += n;
+		len -= n;
+	}
+	return FT_ERR_OK;
+}
+
+// throw away len bytes of a request that is not run
+static long skipAll(int fd, unsigned long len)
+{
+	unsigned char buffer[4096];
+	unsigned long n;
+	long ret;
+
+	while (len > 0) {
+		n = (len < sizeof(buffer)) ? len : sizeof(buffer);
+		ret = readAll(fd, buffer, n);
+		if (ret != FT_ERR_OK)
+			return ret;
+		len -= n;
+	}
+	return FT_ERR_OK;
+}
+
+static long readFile(const char *path, unsigned char **data, unsigned long *size)
+{
+	FILE *fp;
+	long fsize;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+		return FT_ERR_NOTFOUND;
+	fseek(fp, 0, SEEK_END);
+	fsize = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	*data = (unsigned char *)malloc(fsize > 0 ? fsize : 1);
+	if (*data == NULL) {
+		fclose(fp);
+		return FT_ERR_NOTENOUGH;
+	}
+	if (fread(*data, 1, fsize, fp) != (size_t)fsize) {
+		fclose(fp);
+		free(*data);
+		return FT_ERR_FAILED;
+	}
+	fclose(fp);
+
+	*size = fsize;
+	return FT_ERR_OK;
+}
+
+static void streamHook(unsigned long event)
+{
+	unsigned char buffer[STREAM_BUFFER_SIZE];
+	unsigned long n;
+	ssize_t len;
+
+	if (event == STREAM_NEED_INPUT) {
+		len = read(streamInFd, buffer, sizeof(buffer));
+		if (len <= 0)
+			VmStreamCloseInput();
+		else
+			VmStreamPush(buffer, len);
+		return;
+	}
+	fflush(stdout);
+	while ((n = VmStreamPull(buffer, sizeof(buffer))) > 0)
+		writeAll(streamOutFd, buffer, n);
+}
+
+static long initVm(void)
+{
+	long ret;
+
+	ret = mem_initialize(MemArray, MEM_BLOCK_SIZE);
+	if (ret != FT_ERR_OK) {
+		fprintf(stderr, "mem_initialize error\n");
+		return ret;
+	}
+	ret = VmInit(DEFAULT_VM_STACK_SIZE, DEFAULT_NM_STACK_SIZE, DEFAULT_CLASS_HEAP_SIZE, DEFAULT_OBJECT_HEAP_SIZE, DEFAULT_OBJECT_HEAP_MAX_SIZE);
+	if (ret != FT_ERR_OK) {
+		fprintf(stderr, "VmInit error\n");
+		mem_dispose();
+		return ret;
+	}
+	return FT_ERR_OK;
+}
+
+static void freeVm(void)
+{
+	VmFree();
+	mem_dispose();
+}
+
+// the params as the strings of System.getInput()
+static void setInputStrings(int num, char *params[])
+{
+	unsigned long ptr, len;
+	int i;
+
+	ptr = 1;
+	for (i = 0; i < num && i < 255; i++) {
+		len = strlen(params[i]) + 1;
+		if (ptr + len > sizeof(inoutBuff))
+			break;
+		memcpy(&inoutBuff[ptr], params[i], len);
+		ptr += len;
+	}
+	inoutBuff[0] = (unsigned char)i;
+}
+
+static int runOnce(const char *className, int numParams, char *params[])
+{
+	Var retVar;
+	unsigned char retType;
+	long ret;
+
+	setInputStrings(numParams, params);
+	VmStreamReset();
+	VmStreamSetHook(streamHook);
+
+	if (initVm() != FT_ERR_OK)
+		return 1;
+	ret = startStaticMain(className, numParams > 0 ? params[0] : "", &retType, &retVar);
+	if (ret != FT_ERR_OK || retType != RET_TYPE_NONE)
+		fprintf(stderr, "return=%ld retType=%d vmStatus.type=0x%x vmStatus.errNum=0x%lx\n",
+			ret, retType, vmStatus.type, vmStatus.errNum);
+	streamHook(STREAM_HAS_OUTPUT);
+	freeVm();
+
+	if (ret != FT_ERR_OK || retType != RET_TYPE_NONE)
+		return 1;
+	return 0;
+}
+
+// a class name from a request must be a relative name of identifier
+// characters and '/' so it can only load classes from the class
+// directory or the ROM, and must fit the class loader's buffers
+static int isValidClassName(const char *name)
+{
+	unsigned long i, len;
+	char c;
+
+	len = strlen(name);
+	if (len == 0 || len > MAX_CLASS_NAME_LEN || name[0] == '/' || strstr(name, "..") != NULL)
+		return 0;
+	for (i = 0; i < len; i++) {
+		c = name[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+			c == '_' || c == '$' || c == '/'))
+			return 0;
+	}
+	return 1;
+}
+
+static long sendResponse(int outFd, long status, const unsigned char *data, unsigned long len)
+{
+	unsigned char header[8];
+
+	utils_set_uint32b(&header[0], (unsigned long)status);
+	utils_set_uint32b(&header[4], len);
+	if (writeAll(outFd, header, 8) != FT_ERR_OK || writeAll(outFd, data, len) != FT_ERR_OK)
+		return FT_ERR_FAILED;
+	return FT_ERR_OK;
+}
+
+// write what is left of the output stream before the batch resets it
+static void drainStream(unsigned long index, long status, void *arg)
+{
+	streamHook(STREAM_HAS_OUTPUT);
+}
+
+// answer the requests on fd until it is closed, the VM is kept between
+// them unless one ends with a fatal error
+static long serve(int inFd, int outFd)
+{
+	unsigned char header[4];
+	unsigned char *request;
+	const char *className, *param;
+	unsigned long len, nameLen, paramLen;
+	long status, ret;
+
+	streamOutFd = 2;
+	VmStreamSetHook(streamHook);
+	for (;;) {
+		ret = readAll(inFd, header, 4);
+		if (ret == FT_ERR_NOTFOUND)
+			return FT_ERR_OK;
+		if (ret != FT_ERR_OK)
+			return ret;
+		len = utils_get_uint32b(header);
+		if (len > MAX_REQUEST_SIZE) {
+			if (skipAll(inFd, len) != FT_ERR_OK ||
+				sendResponse(outFd, BATCH_FAILED, NULL, 0) != FT_ERR_OK)
+				return FT_ERR_FAILED;
+			continue;
+		}
+		request = (unsigned char *)malloc(len + 2);
+		if (request == NULL)
+			return FT_ERR_NOTENOUGH;
+		if (readAll(inFd, request, len) != FT_ERR_OK) {
+			free(request);
+			return FT_ERR_FAILED;
+		}
+		request[len] = request[len + 1] = '\0';
+
+		className = (const char *)request;
+		if (!isValidClassName(className)) {
+			free(request);
+			if (sendResponse(outFd, BATCH_FAILED, NULL, 0) != FT_ERR_OK)
+				return FT_ERR_FAILED;
+			continue;
+		}
+		nameLen = strlen(className);
+		param = (nameLen < len) ? className + nameLen + 1 : "";
+		paramLen = (nameLen < len) ? strlen(param) : 0;
+		binInput_ext = request + nameLen + paramLen + 2;
+		binInputSize_ext = (len > nameLen + paramLen + 2) ? len - nameLen - paramLen - 2 : 0;
+		binOutputLength_ext = 0;
+		VmStreamReset();
+		VmStreamCloseInput();
+
+		startStaticMainBatch(className, &param, 1, &status, drainStream, NULL);
+		binInput_ext = NULL;
+		binInputSize_ext = 0;
+		free(request);
+
+		if (sendResponse(outFd, status, binOutput_ext, binOutputLength_ext) != FT_ERR_OK)
+			return FT_ERR_FAILED;
+
+		if (vmStatus.type == TYPE_FATAL_ERROR) {
+			freeVm();
+			ret = initVm();
+			if (ret != FT_ERR_OK)
+				return ret;
+		}
+	}
+}
+
+static long serveSocket(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd, conn;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return FT_ERR_FAILED;
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+		close(fd);
+		return FT_ERR_FAILED;
+	}
+
+	// one connection at a time, the VM isn't reentrant
+	for (;;) {
+		conn = accept(fd, NULL, NULL);
+		if (conn < 0)
+			continue;
+		serve(conn, conn);
+		close(conn);
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: javaemu [-c dir] [-r rom] [-d dump] [-i input] [-o output] <className> [param ...]\n");
+	fprintf(stderr, "       javaemu [-c dir] [-r rom] [-d dump] -s | -u <socket path>\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *inputPath = NULL, *outputPath = NULL, *socketPath = NULL;
+	unsigned char *input = NULL;
+	unsigned long inputSize = 0;
+	FILE *fp;
+	int i, server = 0, outFd, ret;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-s") == 0)
+			server = 1;
+		else if (i + 1 >= argc) {
+			usage();
+			return 2;
+		}
+		else if (strcmp(argv[i], "-c") == 0)
+			baseClassDir = argv[++i];
+		else if (strcmp(argv[i], "-r") == 0) {
+			if (readFile(argv[++i], &classRom_ext, &classRomSize_ext) != FT_ERR_OK) {
+				fprintf(stderr, "can't read %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-i") == 0)
+			inputPath = argv[++i];
+		else if (strcmp(argv[i], "-o") == 0)
+			outputPath = argv[++i];
+		else if (strcmp(argv[i], "-d") == 0)
+			setHeapDumpPath(argv[++i]);
+		else if (strcmp(argv[i], "-u") == 0) {
+			socketPath = argv[++i];
+			server = 1;
+		}
+		else {
+			usage();
+			return 2;
+		}
+	}
+
+	binOutput_ext = (unsigned char *)malloc(OUTPUT_BUFFER_SIZE);
+	if (binOutput_ext == NULL)
+		return 1;
+	binOutputSize_ext = OUTPUT_BUFFER_SIZE;
+
+	if (server) {
+		if (initVm() != FT_ERR_OK)
+			return 1;
+		if (socketPath != NULL)
+			ret = (serveSocket(socketPath) == FT_ERR_OK) ? 0 : 1;
+		else {
+			// the responses go to stdout, anything the VM prints to stderr
+			outFd = dup(1);
+			dup2(2, 1);
+			ret = (serve(0, outFd) == FT_ERR_OK) ? 0 : 1;
+		}
+		freeVm();
+		return ret;
+	}
+
+	if (i >= argc) {
+		usage();
+		return 2;
+	}
+	if (inputPath != NULL) {
+		if (readFile(inputPath, &input, &inputSize) != FT_ERR_OK) {
+			fprintf(stderr, "can't read %s\n", inputPath);
+			return 1;
+		}
+		binInput_ext = input;
+		binInputSize_ext = inputSize;
+	}
+
+	fflush(stdout);
+	ret = runOnce(argv[i], argc - i - 1, &argv[i + 1]);
+
+	if (binOutputLength_ext > 0) {
+		if (outputPath != NULL) {
+			fp = fopen(outputPath, "wb");
+			if (fp == NULL || fwrite(binOutput_ext, 1, binOutputLength_ext, fp) != binOutputLength_ext)
+				ret = 1;
+			if (fp != NULL)
+				fclose(fp);
+		}
+		else {
+			fflush(stdout);
+			writeAll(1, binOutput_ext, binOutputLength_ext);
+		}
+	}
+
+	free(input);
+	return ret;
+}
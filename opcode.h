@@ -188,6 +188,7 @@
 #define OP_invokespecial   183
 #define OP_invokestatic    184
 #define OP_invokeinterface 185
+#define OP_invokedynamic   186
 #define OP_new             187
 #define OP_newarray        188
 #define OP_anewarray       189
@@ -1,4 +1,9 @@
 #include "utils.h"
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 static void byte_swap(char *ptr, int size)
 {
@@ -13,29 +18,34 @@ static void byte_swap(char *ptr, int size)
 }
 
 void utils_ltoa(long value, char *ptr, unsigned short radix)
+{
+	utils_lltoa(value, ptr, radix);
+}
+
+void utils_lltoa(long long value, char *ptr, unsigned short radix)
 {
 	int i;
 	unsigned char minus;
+	unsigned long long n;
 
-	if (value < 0)
+	// work on the magnitude so the most negative value converts too
+	if (value < 0) {
 		minus = 1;
-	else
+		n = 0 - (unsigned long long)value;
+	}
+	else {
 		minus = 0;
-
-	if (value == 0) {
-		ptr[0] = '0';
-		ptr[1] = '\0';
+		n = (unsigned long long)value;
 	}
 
-	for (i = 0; value != 0; i++) {
-		if ((value % radix) <= 9) {
-			ptr[i] = (char)('0' + (value % radix));
-		}
-		else {
-			ptr[i] = (char)('a' + (value % radix) - 10);
-		}
-		value /= radix;
-	}
+	i = 0;
+	do {
+		if ((n % radix) <= 9)
+			ptr[i++] = (char)('0' + (n % radix));
+		else
+			ptr[i++] = (char)('a' + (n % radix) - 10);
+		n /= radix;
+	} while (n != 0);
 	if (minus != 0)
 		ptr[i++] = '-';
 
@@ -43,6 +53,80 @@ void utils_ltoa(long value, char *ptr, unsigned short radix)
 	ptr[i] = '\0';
 }
 
+// Format like Double.toString() (Float.toString() if isFloat) of Java:
+// the fewest digits that read back as the same value, written as 123.45
+// if 10^-3 <= |value| < 10^7 and as 1.2345E10 otherwise. ptr must have
+// room for 32 characters.
+void utils_dtoa(double value, char *ptr, int isFloat)
+{
+	char buf[32], digits[20];
+	int i, len, exp, prec;
+
+	if (isnan(value)) {
+		strcpy(ptr, "NaN");
+		return;
+	}
+	if (signbit(value)) {
+		*ptr++ = '-';
+		value = -value;
+	}
+	if (isinf(value)) {
+		strcpy(ptr, "Infinity");
+		return;
+	}
+	if (value == 0.0) {
+		strcpy(ptr, "0.0");
+		return;
+	}
+
+	// buf is "d.ddde+xx", find the shortest one that reads back the same
+	for (prec = 1; prec < 17; prec++) {
+		snprintf(buf, sizeof(buf), "%.*e", prec - 1, value);
+		if (isFloat ? (float)strtod(buf, NULL) == (float)value : strtod(buf, NULL) == value)
+			break;
+	}
+	if (prec == 17)
+		snprintf(buf, sizeof(buf), "%.16e", value);
+	len = 0;
+	for (i = 0; buf[i] != 'e'; i++)
+		if (buf[i] != '.')
+			digits[len++] = buf[i];
+	exp = atoi(&buf[i + 1]);
+	while (len > 1 && digits[len - 1] == '0')
+		len--;
+
+	if (exp >= -3 && exp < 7) {
+		if (exp < 0) {
+			*ptr++ = '0';
+			*ptr++ = '.';
+			for (i = -1; i > exp; i--)
+				*ptr++ = '0';
+			for (i = 0; i < len; i++)
+				*ptr++ = digits[i];
+		}
+		else {
+			for (i = 0; i <= exp; i++)
+				*ptr++ = (i < len) ? digits[i] : '0';
+			*ptr++ = '.';
+			if (len <= exp + 1)
+				*ptr++ = '0';
+			for (i = exp + 1; i < len; i++)
+				*ptr++ = digits[i];
+		}
+		*ptr = '\0';
+	}
+	else {
+		*ptr++ = digits[0];
+		*ptr++ = '.';
+		if (len == 1)
+			*ptr++ = '0';
+		for (i = 1; i < len; i++)
+			*ptr++ = digits[i];
+		*ptr++ = 'E';
+		utils_ltoa(exp, ptr, 10);
+	}
+}
+
 unsigned short utils_get_uint16b( const unsigned char *p_bin )
 {
 	return (unsigned short)( ( ( ( (unsigned short)p_bin[0] ) << 8 ) | (unsigned short)p_bin[1] ) );
@@ -75,12 +159,12 @@ unsigned long utils_get_uint32l( const unsigned char *p_bin )
 
 long utils_get_int32b( const unsigned char *p_bin )
 {
-	return ( ( ( (long)p_bin[0] ) << 24 ) | ( ( (long)p_bin[1] ) << 16 ) | ( ( (long)p_bin[2] ) << 8 ) | (long)p_bin[3] );
+	return (long)(int)utils_get_uint32b( p_bin );
 }
 
 long utils_get_int32l( const unsigned char *p_bin )
 {
-	return ( ( ( (long)p_bin[3] ) << 24 ) | ( ( (long)p_bin[2] ) << 16 ) | ( ( (long)p_bin[1] ) << 8 ) | (long)p_bin[0] );
+	return (long)(int)utils_get_uint32l( p_bin );
 }
 
 void utils_set_uint16b( unsigned char *p_bin, unsigned short value )
@@ -138,3 +222,12 @@ void utils_set_int32l( unsigned char *p_bin, long value )
 	p_bin[2] = (unsigned char)( ( value >> 16 ) & 0xff );
 	p_bin[3] = (unsigned char)( ( value >> 24 ) & 0xff );
 }
+
+// a free running microsecond clock, only good for measuring intervals
+unsigned long utils_get_usec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
@@ -21,6 +21,8 @@ extern "C" {
 #endif // __cplusplus
 
 void utils_ltoa(long value, char *ptr, unsigned short radix);
+void utils_lltoa(long long value, char *ptr, unsigned short radix);
+void utils_dtoa(double value, char *ptr, int isFloat);
 
 unsigned short utils_get_uint16b( const unsigned char *p_bin );
 unsigned short utils_get_uint16l( const unsigned char *p_bin );
@@ -39,6 +41,8 @@ void utils_set_uint32l( unsigned char *p_bin, unsigned long value );
 void utils_set_int32b( unsigned char *p_bin, long value );
 void utils_set_int32l( unsigned char *p_bin, long value );
 
+unsigned long utils_get_usec(void);
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
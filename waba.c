@@ -24,6 +24,7 @@ Cambridge, MA 02139, USA.
 #include "debuglog.h"
 #include "waba_heap.h"
 #include <string.h>
+#include <math.h>
 
 /*
 
@@ -153,16 +154,23 @@ static const char *errorMessages[] = {
 
 static unsigned char *skipClassConstant(WClass *wclass, unsigned short idx, unsigned char *p);
 static unsigned char *loadClassField(WClass *wclass, WClassField *field, unsigned char *p);
+static int layoutClassFields(WClass *wclass, WClass *superClass);
 static Var constantToVar(WClass *wclass, unsigned short idx);
+static int loadClassStrings(WClass *wclass);
+static int addStaticRoot(WObject *slot);
 static unsigned char *loadClassMethod(WClass *wclass, WClassMethod *method, unsigned char *p);
+static int loadClassAttributes(WClass *wclass, unsigned char *p);
+static long concatStrings(WClass *wclass, unsigned short idx, Var *stack, unsigned char *retType, Var *retValue);
 static WObject createMultiArray(long ndim, char *desc, Var *sizes);
 static WClassField *getField(WClass *wclass, UtfString name, UtfString desc, WClass **vclass);
 static WClassField *getFieldByIndex(WClass *wclass, unsigned short fieldIndex, WClass **vclass);
 static WClass *getClassByIndex(WClass *wclass, unsigned short classIndex);
+static WClassHandler *findHandler(WClass *wclass, WClassMethod *method, unsigned long pcOffset, WClass *exceptionClass);
 static long countMethodParams(UtfString desc);
-static NativeFunc getNativeMethod(WClass *wclass, UtfString methodName, UtfString methodDesc);
+static const NativeMethod *getNativeMethod(WClass *wclass, UtfString methodName, UtfString methodDesc);
 static void setClassHooks(WClass *wclass);
 static unsigned char arrayType(char c);
+static int initRuntimeExceptions(void);
 
 //
 // global vars
@@ -185,9 +193,47 @@ static unsigned long classHeapSize;
 static unsigned long classHeapUsed;
 static WClass **classHashList;
 
+// static class variables that can hold object references. The slots are
+// collected as classes load so the garbage collector doesn't have to
+// look through every field of every class to find its static roots.
+static WObject **staticRoots;
+static unsigned long numStaticRoots;
+static unsigned long staticRootsSize; // in entries
+
 // error status
 ErrorStatus vmStatus;
 
+// The runtime exceptions the VM throws itself. Their classes and
+// constructors are looked up once by VmInit() so throwing one does not
+// go through the class and method lookup by name.
+typedef struct {
+	char *className;
+	WClass *wclass;
+	WClassMethod *initMethod;
+	WObject instance; // with PREALLOCATED_EXCEPTIONS
+} RuntimeExceptionClass;
+
+#define EXCEPTION_Runtime			0
+#define EXCEPTION_NullPointer		1
+#define EXCEPTION_IndexOutOfBounds	2
+#define EXCEPTION_Arithmetic		3
+#define EXCEPTION_ClassNotFound		4
+#define EXCEPTION_ClassCast			5
+#define EXCEPTION_NegativeArraySize	6
+#define EXCEPTION_ArrayStore		7
+#define NUM_RUNTIME_EXCEPTIONS		8
+
+static RuntimeExceptionClass runtimeExceptions[NUM_RUNTIME_EXCEPTIONS] = {
+	{ "java/lang/RuntimeException" },
+	{ "java/lang/NullPointerException" },
+	{ "java/lang/ArrayIndexOutOfBoundsException" },
+	{ "java/lang/ArithmeticException" },
+	{ "java/lang/ClassNotFoundException" },
+	{ "java/lang/ClassCastException" },
+	{ "java/lang/NegativeArraySizeException" },
+	{ "java/lang/ArrayStoreException" },
+};
+
 //
 // public functions
 //
@@ -204,7 +250,7 @@ ErrorStatus vmStatus;
  */
 
 long VmInit(unsigned long vmStackSizeInBytes, unsigned long nmStackSizeInBytes,
-	unsigned long _classHeapSize, unsigned long _objectHeapSize ) {
+	unsigned long _classHeapSize, unsigned long _objectHeapSize, unsigned long _objectHeapMaxSize ) {
 	unsigned long i;
 
 	if( vmInitialized )
@@ -228,6 +274,9 @@ long VmInit(unsigned long vmStackSizeInBytes, unsigned long nmStackSizeInBytes,
 	classHeap = NULL;
 	classHeapSize = _classHeapSize;
 	classHeapUsed = 0;
+	staticRoots = NULL;
+	numStaticRoots = 0;
+	staticRootsSize = 0;
 
 	// allocate stacks and init
 	vmStack = (Var *)mem_alloc(vmStackSizeInBytes);
@@ -244,7 +293,7 @@ long VmInit(unsigned long vmStackSizeInBytes, unsigned long nmStackSizeInBytes,
 	for (i = 0; i < CLASS_HASH_SIZE; i++)
 		classHashList[i] = NULL;
 
-	if (initObjectHeap(_objectHeapSize) != FT_ERR_OK)
+	if (initObjectHeap(_objectHeapSize, _objectHeapMaxSize) != FT_ERR_OK)
 		goto error;
 
 	if( initClassBlock() != FT_ERR_OK ){
@@ -259,6 +308,12 @@ long VmInit(unsigned long vmStackSizeInBytes, unsigned long nmStackSizeInBytes,
 		goto error;
 	}
 
+	if (initRuntimeExceptions() != FT_ERR_OK) {
+		closeClassBlock();
+		freeObjectHeap();
+		goto error;
+	}
+
 	vmInitialized = 1;
 	
 	return FT_ERR_OK;
@@ -285,6 +340,8 @@ error:
 }
 
 void VmFree(void) {
+	unsigned long i;
+
 	if (!vmInitialized)
 		return;
 
@@ -293,6 +350,11 @@ void VmFree(void) {
 	// destroy methods 
 
 	stringClass = NULL;
+	for (i = 0; i < NUM_RUNTIME_EXCEPTIONS; i++) {
+		runtimeExceptions[i].wclass = NULL;
+		runtimeExceptions[i].initMethod = NULL;
+		runtimeExceptions[i].instance = WOBJECT_NULL;
+	}
 	closeClassBlock();
 	freeObjectHeap();
 
@@ -304,6 +366,12 @@ void VmFree(void) {
 	classHeap = NULL;
 	mem_free(classHashList);
 	classHashList = NULL;
+	if (staticRoots != NULL) {
+		mem_free(staticRoots);
+		staticRoots = NULL;
+	}
+	numStaticRoots = 0;
+	staticRootsSize = 0;
 
 	vmInitialized = 0;
 }
@@ -443,11 +511,17 @@ WClass *getClass(UtfString className) {
 				VmSetFatalError(ERR_LoadConst, &className, 1 );
 				return NULL;
 			}
+			// a long or double takes two entries, the second one is not used
+			if ((CONS_tag(wclass, i) == CONSTANT_Long || CONS_tag(wclass, i) == CONSTANT_Double) &&
+				i + 1 < wclass->numConstants)
+				wclass->constantOffsets[++i] = CONSTANT_Reserved;
 		}
 	}
 	else{
 		wclass->constantOffsets = NULL;
 	}
+	if (loadClassStrings(wclass) != FT_ERR_OK)
+		return NULL;
 
 	// second attribute section
 	wclass->attrib2 = p;
@@ -483,13 +557,10 @@ WClass *getClass(UtfString className) {
 		memmove(wclass->superClasses, superClass->superClasses, superClass->numSuperClasses * sizeof(WClass *));
 		wclass->superClasses[superClass->numSuperClasses] = superClass;
 
-		// inherit num of superclass variables to start
-		wclass->numVars = superClass->numVars;
 	}else{
 		superClass = NULL;
 		wclass->numSuperClasses = 0;
 		wclass->superClasses = NULL;
-		wclass->numVars = 0;
 	}
 
 	// skip past interfaces
@@ -514,6 +585,8 @@ WClass *getClass(UtfString className) {
 	else{
 		wclass->fields = NULL;
 	}
+	if (layoutClassFields(wclass, superClass) != FT_ERR_OK)
+		return NULL;
 
 	// parse methods
 	wclass->numMethods = utils_get_uint16b(p);
@@ -535,7 +608,12 @@ WClass *getClass(UtfString className) {
 		wclass->methods = NULL;
 	}
 
-	// skip final attributes section
+	// final attributes section, only the bootstrap methods of
+	// invokedynamic are used
+	if (loadClassAttributes(wclass, p) != FT_ERR_OK) {
+		VmSetFatalError(ERR_LoadConst, &className, 1 );
+		return NULL;
+	}
 
 	// set hooks (before class init which might create/free objects of this type)
 	setClassHooks(wclass);
@@ -572,33 +650,123 @@ static unsigned char *skipClassConstant(WClass *wclass, unsigned short idx, unsi
 		case CONSTANT_Methodref:
 		case CONSTANT_InterfaceMethodref:
 		case CONSTANT_NameAndType:
+		case CONSTANT_Dynamic:
+		case CONSTANT_InvokeDynamic:
 			p += 4;
 			break;
+		case CONSTANT_MethodHandle:
+			p += 3;
+			break;
 		case CONSTANT_Class:
 		case CONSTANT_String:
+		case CONSTANT_MethodType:
 			p += 2;
 			break;
 		case CONSTANT_Long:
 		case CONSTANT_Double:
+			p += 8;
+			break;
 		default:
 			return NULL;
 	}
 	return p;
 }
 
+// Set up the table of the String constants of a class. The String objects
+// are created the first time a constant is loaded and kept in the table
+// (which is a GC root) so ldc of the same literal always gives the same
+// object instead of allocating a new one each time it runs.
+static int loadClassStrings(WClass *wclass) {
+	unsigned short i, n;
+
+	n = 0;
+	for (i = 1; i < wclass->numConstants; i++)
+		if (CONS_tag(wclass, i) == CONSTANT_String)
+			n++;
+	wclass->numStrings = n;
+	wclass->stringIndexes = NULL;
+	wclass->strings = NULL;
+	if (n == 0)
+		return FT_ERR_OK;
+
+	wclass->stringIndexes = (unsigned short *)allocClassPart(n * sizeof(unsigned short));
+	wclass->strings = (WObject *)allocClassPart(n * sizeof(WObject));
+	if (wclass->stringIndexes == NULL || wclass->strings == NULL)
+		return FT_ERR_NOTENOUGH;
+	n = 0;
+	for (i = 1; i < wclass->numConstants; i++) {
+		if (CONS_tag(wclass, i) != CONSTANT_String)
+			continue;
+		wclass->stringIndexes[n] = i;
+		wclass->strings[n] = WOBJECT_NULL;
+		if (addStaticRoot(&wclass->strings[n]) != FT_ERR_OK)
+			return FT_ERR_NOTENOUGH;
+		n++;
+	}
+	return FT_ERR_OK;
+}
+
+// look for a String constant with the same value that another class
+// has already loaded so equal literals are the same object in all classes
+static WObject findInternedString(UtfString s) {
+	WClass *wclass;
+	UtfString t;
+	unsigned long i, j;
+
+	for (i = 0; i < CLASS_HASH_SIZE; i++) {
+		for (wclass = classHashList[i]; wclass != NULL; wclass = wclass->nextClass) {
+			for (j = 0; j < wclass->numStrings; j++) {
+				if (wclass->strings[j] == WOBJECT_NULL)
+					continue;
+				t = getUtfString(wclass, CONS_stringIndex(wclass, wclass->stringIndexes[j]));
+				if (t.len == s.len && memcmp(t.str, s.str, s.len) == 0)
+					return wclass->strings[j];
+			}
+		}
+	}
+	return WOBJECT_NULL;
+}
+
+static WObject internString(WClass *wclass, unsigned short idx) {
+	UtfString s;
+	WObject obj;
+	long lo, hi, mid;
+
+	lo = 0;
+	hi = (long)wclass->numStrings - 1;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (wclass->stringIndexes[mid] == idx) {
+			if (wclass->strings[mid] != WOBJECT_NULL)
+				return wclass->strings[mid];
+			s = getUtfString(wclass, CONS_stringIndex(wclass, idx));
+			obj = findInternedString(s);
+			if (obj == WOBJECT_NULL)
+				obj = createStringFromUtf(s);
+			wclass->strings[mid] = obj;
+			return obj;
+		}
+		if (wclass->stringIndexes[mid] < idx)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return WOBJECT_NULL;
+}
+
 static Var constantToVar(WClass *wclass, unsigned short idx) {
 	Var v;
-	unsigned short stringIndex;
 
 	switch (CONS_tag(wclass, idx)) {
 		case CONSTANT_Integer:
 			v.intValue = CONS_integer(wclass, idx);
 			break;
 		case CONSTANT_String:
-			stringIndex = CONS_stringIndex(wclass, idx);
-			v.obj = createStringFromUtf(getUtfString(wclass, stringIndex));
+			v.obj = internString(wclass, idx);
 			break;
 		case CONSTANT_Float:
+			v.floatValue = CONS_float(wclass, idx);
+			break;
 		case CONSTANT_Long:
 		case CONSTANT_Double:
 		default:
@@ -609,18 +777,51 @@ static Var constantToVar(WClass *wclass, unsigned short idx) {
 	return v;
 }
 
+static int addStaticRoot(WObject *slot) {
+	WObject **roots;
+	unsigned long size;
+
+	if (numStaticRoots == staticRootsSize) {
+		size = staticRootsSize * 2;
+		if (size == 0)
+			size = 64;
+		roots = (WObject **)mem_alloc(size * sizeof(WObject *));
+		if (roots == NULL) {
+			VmSetFatalErrorNum(ERR_CantAllocateMemory);
+			return FT_ERR_NOTENOUGH;
+		}
+		if (staticRoots != NULL) {
+			memmove(roots, staticRoots, numStaticRoots * sizeof(WObject *));
+			mem_free(staticRoots);
+		}
+		staticRoots = roots;
+		staticRootsSize = size;
+	}
+	staticRoots[numStaticRoots++] = slot;
+	return FT_ERR_OK;
+}
+
 static unsigned char *loadClassField(WClass *wclass, WClassField *field, unsigned char *p) {
 	unsigned long i, bytesCount;
 	unsigned short attrCount, nameIndex;
-	UtfString attrName;
+	UtfString attrName, desc;
 
 	field->header = p;
+	desc = getUtfString(wclass, FIELD_descIndex(field));
+	field->type = arrayType(desc.str[0]);
 
-	// compute offset of this field's variable in the object
+	// the offset of this field's variable in the object is computed
+	// once all fields are loaded (see layoutClassFields())
 	if (!FIELD_isStatic(field))
-		field->var.varOffset = wclass->numVars++;
-	else
+		field->var.varOffset = 0;
+	else {
 		field->var.staticVar.obj = WOBJECT_NULL;
+		// remember where static object and array references are kept
+		if (field->type == TYPE_OBJECT || field->type == TYPE_ARRAY) {
+			if (addStaticRoot(&field->var.staticVar.obj) != FT_ERR_OK)
+				return NULL;
+		}
+	}
 
 	p += 2; // access flag
 	p += 2; // field name
@@ -635,8 +836,14 @@ static unsigned char *loadClassField(WClass *wclass, WClassField *field, unsigne
 		bytesCount = utils_get_uint32b(p);
 		p += 4;
 		if (FIELD_isStatic(field) && attrName.len == 13 && bytesCount == 2 &&
-			strncmp(attrName.str, "ConstantValue", 13) == 0)
-			field->var.staticVar = constantToVar(wclass, utils_get_uint16b(p));
+			strncmp(attrName.str, "ConstantValue", 13) == 0) {
+			// a double is stored by its bits like a long
+			if (CONS_tag(wclass, utils_get_uint16b(p)) == CONSTANT_Long ||
+				CONS_tag(wclass, utils_get_uint16b(p)) == CONSTANT_Double)
+				setInt64(field->var.staticVars, CONS_long(wclass, utils_get_uint16b(p)));
+			else
+				field->var.staticVar = constantToVar(wclass, utils_get_uint16b(p));
+		}
 		else
 			; // MS Java has COM_MapsTo field attributes which we skip
 		p += bytesCount;
@@ -644,6 +851,92 @@ static unsigned char *loadClassField(WClass *wclass, WClassField *field, unsigne
 	return p;
 }
 
+// size of an object variable of a field type, see OP_getfield
+static unsigned long fieldTypeSize(unsigned char type) {
+	switch (type) {
+		case TYPE_OBJECT:
+		case TYPE_ARRAY:
+			return sizeof(WObject);
+		case TYPE_INT:
+		case TYPE_FLOAT:
+			return sizeof(long);
+		case TYPE_CHAR:
+		case TYPE_SHORT:
+			return sizeof(short);
+		case TYPE_BOOLEAN:
+		case TYPE_BYTE:
+			return sizeof(char);
+		case TYPE_LONG:
+			return sizeof(int64);
+		case TYPE_DOUBLE:
+			return sizeof(float64);
+	}
+	return sizeof(Var);
+}
+
+// Compute where the instance variables go in an object. The variables
+// of the superclass come first, then the object references of this
+// class (so the GC finds the references of an object in a few runs,
+// see refOffsets) followed by the other variables from the largest to
+// the smallest so they are packed without padding.
+static int layoutClassFields(WClass *wclass, WClass *superClass) {
+	static const unsigned char sizeOrder[] = { 8, 4, 2, 1 };
+	WClassField *field;
+	unsigned long i, j, size, offset, numRefs;
+
+	offset = 0;
+	numRefs = 0;
+	if (superClass != NULL) {
+		offset = superClass->varsSize;
+		numRefs = superClass->numRefs;
+	}
+	for (i = 0; i < wclass->numFields; i++) {
+		field = &wclass->fields[i];
+		if (!FIELD_isStatic(field) && (field->type == TYPE_OBJECT || field->type == TYPE_ARRAY))
+			numRefs++;
+	}
+	wclass->numRefs = (unsigned short)numRefs;
+	wclass->refOffsets = NULL;
+	if (numRefs != 0) {
+		wclass->refOffsets = (unsigned short *)allocClassPart(numRefs * sizeof(unsigned short));
+		if (wclass->refOffsets == NULL)
+			return FT_ERR_NOTENOUGH;
+	}
+
+	numRefs = 0;
+	if (superClass != NULL && superClass->numRefs != 0) {
+		memmove(wclass->refOffsets, superClass->refOffsets, superClass->numRefs * sizeof(unsigned short));
+		numRefs = superClass->numRefs;
+	}
+	for (i = 0; i < wclass->numFields; i++) {
+		field = &wclass->fields[i];
+		if (FIELD_isStatic(field) || (field->type != TYPE_OBJECT && field->type != TYPE_ARRAY))
+			continue;
+		field->var.varOffset = offset;
+		wclass->refOffsets[numRefs++] = (unsigned short)offset;
+		offset += sizeof(WObject);
+	}
+	for (j = 0; j < sizeof(sizeOrder); j++) {
+		for (i = 0; i < wclass->numFields; i++) {
+			field = &wclass->fields[i];
+			if (FIELD_isStatic(field) || field->type == TYPE_OBJECT || field->type == TYPE_ARRAY)
+				continue;
+			size = fieldTypeSize(field->type);
+			if (size != sizeOrder[j])
+				continue;
+			field->var.varOffset = offset;
+			offset += size;
+		}
+	}
+
+	// pad to a full Var so the variables of subclasses are aligned
+	offset = (offset + sizeof(Var) - 1) & ~(sizeof(Var) - 1);
+	if (offset > 0xFFFF)
+		return FT_ERR_NOTSUPPORTED;
+	wclass->varsSize = (unsigned short)offset;
+	return FT_ERR_OK;
+}
+
 static unsigned char *loadClassMethod(WClass *wclass, WClassMethod *method, unsigned char *p) {
 	unsigned long i, j, bytesCount;
 	unsigned short attrCount, attrNameIndex, numAttributes;
@@ -652,6 +945,7 @@ static unsigned char *loadClassMethod(WClass *wclass, WClassMethod *method, unsi
 	UtfString attrName, methodName, methodDesc;
 	WClassHandler *handler;
 	unsigned long size;
+	const NativeMethod *native;
 
 	method->header = p;
 	p += 2; // access flag
@@ -696,6 +990,7 @@ static unsigned char *loadClassMethod(WClass *wclass, WClassMethod *method, unsi
 			handler->handler_pc = utils_get_uint16b(p);
 			p += 2;
 			handler->catch_type = utils_get_uint16b(p);
+			handler->catchClass = NULL;
 			p += 2;
 		}
 
@@ -727,16 +1022,57 @@ static unsigned char *loadClassMethod(WClass *wclass, WClassMethod *method, unsi
 		method->returnsValue = 1;
 	else
 		method->returnsValue = 0;
+	if (methodDesc.len >= 2 && methodDesc.str[methodDesc.len - 2] == ')' &&
+		(methodDesc.str[methodDesc.len - 1] == 'J' || methodDesc.str[methodDesc.len - 1] == 'D'))
+		method->returnsWide = 1;
+	else
+		method->returnsWide = 0;
 
 	// resolve native functions
+	method->isLeafNative = 0;
 	if (METH_isNative(method)){
-		method->code.nativeFunc = getNativeMethod(wclass, methodName, methodDesc);
-		if( method->code.nativeFunc == NULL )
+		native = getNativeMethod(wclass, methodName, methodDesc);
+		if( native == NULL )
 			return NULL;
+		method->code.nativeFunc = native->func;
+		if (native->flags & NATIVE_LEAF)
+			method->isLeafNative = 1;
 	}
 	return p;
 }
 
+static int loadClassAttributes(WClass *wclass, unsigned char *p) {
+	unsigned long i, j, bytesCount;
+	unsigned short attrCount;
+	UtfString attrName;
+	unsigned char *bsm;
+
+	wclass->numBootstrapMethods = 0;
+	wclass->bootstrapMethods = NULL;
+	attrCount = utils_get_uint16b(p);
+	p += 2;
+	for (i = 0; i < attrCount; i++) {
+		attrName = getUtfString(wclass, utils_get_uint16b(p));
+		p += 2;
+		bytesCount = utils_get_uint32b(p);
+		p += 4;
+		if (attrName.len == 16 && strncmp(attrName.str, "BootstrapMethods", 16) == 0) {
+			wclass->numBootstrapMethods = utils_get_uint16b(p);
+			wclass->bootstrapMethods = (unsigned char **)allocClassPart(
+				wclass->numBootstrapMethods * sizeof(unsigned char *));
+			if (wclass->bootstrapMethods == NULL)
+				return FT_ERR_NOTENOUGH;
+			bsm = p + 2;
+			for (j = 0; j < wclass->numBootstrapMethods; j++) {
+				wclass->bootstrapMethods[j] = bsm;
+				bsm += 4 + BSM_numArgs(bsm) * 2;
+			}
+		}
+		p += bytesCount;
+	}
+	return FT_ERR_OK;
+}
+
 static long countMethodParams(UtfString desc) {
 	unsigned long n;
 	char *c;
@@ -756,17 +1092,26 @@ static long countMethodParams(UtfString desc) {
 				n++;
 				c++;
 				break;
-			case 'D':
 			case 'J':
-				// long/double not supported
-				return -2;
+			case 'D':
+				// long and double take two Vars
+				n += 2;
+				c++;
+				break;
 			case 'L':
 				c++;
 				while (*c++ != ';');
 				n++;
 				break;
 			case '[':
-				c++;
+				// an array is a single reference whatever its element type
+				while (*c == '[')
+					c++;
+				if (*c == 'L')
+					while (*c++ != ';');
+				else
+					c++;
+				n++;
 				break;
 			case ')':
 				return n;
@@ -790,29 +1135,34 @@ WObject createObject(WClass *wclass) {
 		VmSetFatalErrorNum(ERR_CantCreateObject);
 		return WOBJECT_NULL; // interface or abstract class
 	}
-	obj = allocObject(WCLASS_objectSize(wclass));
+	obj = allocObjectFast(WCLASS_objectSize(wclass));
+	if (obj == WOBJECT_NULL)
+		obj = allocObject(WCLASS_objectSize(wclass));
 	if (obj == WOBJECT_NULL)
 		return WOBJECT_NULL;
-	WOBJ_class(obj) = wclass;
+	WOBJ_setClass(obj, wclass);
 	return obj;
 }
 
 long arrayTypeSize(unsigned char type) {
 	switch (type) {
+		// the size of the C type the elements are accessed with
 		case TYPE_OBJECT:  // object
 		case TYPE_ARRAY:  // array
+			return sizeof(WObject);
 		case TYPE_FLOAT:  // float
+			return sizeof(float32);
 		case TYPE_INT: // int
-			return 4;
+			return sizeof(long);
 		case TYPE_BOOLEAN: // boolean
 		case TYPE_BYTE: // byte
 			return 1;
 		case TYPE_CHAR:  // char
 		case TYPE_SHORT:  // short
 			return 2;
-//		case TYPE_DOUBLE:  // double (invalid)
-//		case TYPE_LONG: // long (invalid)
-//			return 8;
+		case TYPE_LONG: // long
+		case TYPE_DOUBLE:  // double
+			return 8;
 	}
 	VmSetFatalErrorNum(ERR_ParamError);
 	return 0;
@@ -822,7 +1172,7 @@ long arraySize(unsigned char type, long len) {
 	long typesize, size;
 
 	typesize = arrayTypeSize(type);
-	size = (3 * sizeof(Var)) + (typesize * len);
+	size = sizeof(Var) + (typesize * len); // header word and elements
 	// align to 4 byte boundry
 	size = (size + 3) & ~3;
 	return size;
@@ -831,17 +1181,16 @@ long arraySize(unsigned char type, long len) {
 WObject createArrayObject(unsigned char type, long len) {
 	WObject obj;
 
-	if( len < 0 ){
+	if( len < 0 || len > ARRAY_MAX_LEN ){
 		VmSetFatalErrorNum(ERR_ParamError);
 		return WOBJECT_NULL;
 	}
-	obj = allocObject(arraySize(type, len));
+	obj = allocObjectFast(arraySize(type, len));
+	if (obj == WOBJECT_NULL)
+		obj = allocObject(arraySize(type, len));
 	if ( obj == WOBJECT_NULL)
 		return WOBJECT_NULL;
-	// pointer to class is NULL for arrays
-	WOBJ_class(obj) = NULL;
-	WOBJ_arrayType(obj) = type;
-	WOBJ_arrayLen(obj) = len;
+	WOBJ_setArrayHeader(obj, type, len);
 	return obj;
 }
 
@@ -936,6 +1285,34 @@ static WClass *getClassByIndex(WClass *wclass, unsigned short classIndex) {
 	return getClass(className);
 }
 
+// Find the handler in method for an exception of exceptionClass thrown at
+// pcOffset in its code. The handlers are tried in the order of the class
+// file as the inner ones come first. The catch class of a handler is
+// looked up by name only the first time (and only if pcOffset is in its
+// range) and then kept in the handler.
+static WClassHandler *findHandler(WClass *wclass, WClassMethod *method, unsigned long pcOffset, WClass *exceptionClass) {
+	WClassHandler *handler;
+	unsigned short i;
+
+	for (i = 0; i < method->numHandlers; i++) {
+		handler = &method->handlers[i];
+		// NOTE: end_pc is included since pc is past the invoke when the
+		// exception comes from a called method
+		if (pcOffset < handler->start_pc || pcOffset > handler->end_pc)
+			continue;
+		if (handler->catch_type == 0)
+			return handler;
+		if (handler->catchClass == NULL) {
+			handler->catchClass = getClassByIndex(wclass, handler->catch_type);
+			if (handler->catchClass == NULL)
+				return NULL; // fatal error
+		}
+		if (compatible(exceptionClass, handler->catchClass))
+			return handler;
+	}
+	return NULL;
+}
+
 static WClassField *getField(WClass *wclass, UtfString name, UtfString desc, WClass **vclass) {
 	WClassField *field;
 	UtfString fname, fdesc;
@@ -1094,7 +1471,9 @@ int compatibleArray(WObject obj, UtfString arrayName) {
 long getMemInfo(T_MEMINFO *p_info)
 {
 	p_info->totalObjectMem = getTotalMemSize();
+	p_info->maxObjectMem = getMaxMemSize();
 	p_info->unusedObjectMem = getUnusedMemSize();
+	p_info->largeObjectMem = getLargeObjectSize();
 	p_info->totalClassMem = classHeapSize;
 	p_info->unusedClassMem = classHeapSize - classHeapUsed;
 	p_info->vmStackSize = vmStackSize;
@@ -1108,38 +1487,38 @@ long getMemInfo(T_MEMINFO *p_info)
 //
 // garbage collection
 //
-void gc(void) {
-	WClass *wclass;
-	WObject obj;
-	unsigned long i, j;
+// call visit for everything that may refer to an object from outside the
+// heap. NOTE: the vm stack is not typed, so the values on it that are not
+// references are passed as well.
+void walkRoots(RootVisitor visit, void *arg) {
+	unsigned long i;
 
-	// mark objects on vm stack
+	// objects on vm stack
 	for (i = 0; i < vmStackPtr; i++)
-		if (VALID_OBJ(vmStack[i].obj))
-			markObject(vmStack[i].obj);
+		visit(vmStack[i].obj, ROOT_VM_STACK, arg);
 
-	// mark objects on native stack
+	// objects on native stack
 	for (i = 0; i < nmStackPtr; i++)
-		if (VALID_OBJ(nmStack[i]))
-			markObject(nmStack[i]);
+		visit(nmStack[i], ROOT_NM_STACK, arg);
 
-	// mark all static class objects
-	for (i = 0; i < CLASS_HASH_SIZE; i++) {
-		wclass = classHashList[i];
-		while (wclass != NULL) {
-			for (j = 0; j < wclass->numFields; j++) {
-				WClassField *field;
+	// all static class objects. NOTE: numStaticRoots is read on
+	// every pass since the slots are added as classes load, the slots
+	// themselves never move (they are in the class heap)
+	for (i = 0; i < numStaticRoots; i++)
+		visit(*staticRoots[i], ROOT_STATIC, arg);
+}
 
-				field = &wclass->fields[j];
-				if (!FIELD_isStatic(field))
-					continue;
-				obj = field->var.staticVar.obj;
-				if (VALID_OBJ(obj))
-					markObject(obj);
-			}
-			wclass = wclass->nextClass;
-		}
-	}
+static void markRoot(WObject obj, unsigned long kind, void *arg) {
+	markObject(obj);
+}
+
+void gc(unsigned long reason) {
+	beginGcRecord(reason);
+
+	// NOTE: markObject() only queues the roots, the objects reachable
+	// from them are marked by traceObjects() below
+	walkRoots(markRoot, NULL);
+	traceObjects();
 	sweepObjects();
 }
 
@@ -1203,54 +1582,22 @@ WObject popObject(void) {
 	return nmStack[--nmStackPtr];
 }
 
-static NativeFunc getNativeMethod(WClass *wclass, UtfString methodName, UtfString methodDesc) {
+static const NativeMethod *getNativeMethod(WClass *wclass, UtfString methodName, UtfString methodDesc) {
 	UtfString className;
-	NativeMethod *nm;
-	unsigned long hash, classHash, methodHash;
-	unsigned short top, bot, mid;
+	const NativeMethod *native;
 
 	className = getUtfString(wclass, wclass->classNameIndex);
-	classHash = genHashCode(className) % 65536;
-	methodHash = (genHashCode(methodName) + genHashCode(methodDesc)) % 65536;
-	hash = (classHash << 16) + methodHash;
-
-	// binary search to find matching hash value
-	top = 0;
-	bot = (unsigned short)NumberOfNativeMethods;
-	if (bot == 0)
-		return NULL;
-	while (1) {
-		mid = (unsigned short)( (bot + top) / 2 );
-		nm = &nativeMethods[mid];
-		if (hash == nm->hash)
-			return nm->func;
-		if (mid == top)
-			break; // not found
-		if (hash < nm->hash)
-			bot = mid;
-		else
-			top = mid;
-	}
+	native = findNativeMethod(className, methodName, methodDesc);
+	if (native != NULL)
+		return native;
 	VmSetFatalError(ERR_CantFindNative, &methodName, 1 );
 
 #if 1
-	{
-	// for debug
-	unsigned short i;
-
+	// for debug, the entry to add to nativeMethods[]
 	debuglog("** Native Method Missing:\n");
-	debuglog("// ");
-	for (i = 0; i < className.len; i++)
-		debuglog("%c", className.str[i]);
-	debuglog("_");
-	for (i = 0; i < methodName.len; i++)
-		debuglog("%c", methodName.str[i]);
-	debuglog("_");
-	for (i = 0; i < methodDesc.len; i++)
-		debuglog("%c", methodDesc.str[i]);
-	debuglog("\n");
-	debuglog("{ %uUL, func },\n", hash);
-	}
+	debuglog("{ \"%.*s\", \"%.*s\", \"%.*s\", func },\n",
+		(int)className.len, className.str, (int)methodName.len, methodName.str,
+		(int)methodDesc.len, methodDesc.str);
 #endif
 	
 	return NULL;
@@ -1291,7 +1638,7 @@ static void setClassHooks(WClass *wclass) {
 		if (className.len == nameLen &&
 			strncmp(className.str, hook->className, nameLen) == 0) {
 			wclass->objDestroyFunc = hook->destroyFunc;
-			wclass->numVars += hook->varsNeeded;
+			wclass->varsSize += hook->varsNeeded * sizeof(Var);
 			return;
 		}
 	}
@@ -1340,7 +1687,288 @@ static void setClassHooks(WClass *wclass) {
 // Inner Loops - A sourcebook for fast 32-bit software development
 // by Rick Booth
 //
-long executeMethod(WClass *wclass, WClassMethod *method, Var params[], unsigned short numParams, unsigned char *retType, Var* retValue) {
+//
+// String Concatenation
+//
+
+// javac (9 and later) compiles string concatenation to an invokedynamic
+// bootstrapped by StringConcatFactory. Instead of linking a call site
+// the VM does the concatenation itself: the recipe of
+// makeConcatWithConstants has \1 where an argument goes and \2 where
+// the next bootstrap argument constant goes (makeConcat has no recipe,
+// just the arguments). The length of the result is measured first so the
+// String is written with a single allocation.
+
+#define CONCAT_ARG		1
+#define CONCAT_CONSTANT	2
+#define CONCAT_MAX_ARGS	200 // the most javac puts in one call site
+
+static int isConcatBootstrap(WClass *wclass, unsigned char *bsm, int *hasRecipe) {
+	unsigned short handle, ref;
+	UtfString className, name;
+
+	handle = BSM_methodRef(bsm);
+	if (CONS_tag(wclass, handle) != CONSTANT_MethodHandle)
+		return 0;
+	ref = CONS_methodHandleRef(wclass, handle);
+	className = getUtfString(wclass, CONS_nameIndex(wclass, CONS_classIndex(wclass, ref)));
+	name = getUtfString(wclass, CONS_nameIndex(wclass, CONS_nameAndTypeIndex(wclass, ref)));
+	if (className.len != 36 || strncmp(className.str, "java/lang/invoke/StringConcatFactory", 36) != 0)
+		return 0;
+	if (name.len == 23 && strncmp(name.str, "makeConcatWithConstants", 23) == 0)
+		*hasRecipe = 1;
+	else if (name.len == 10 && strncmp(name.str, "makeConcat", 10) == 0)
+		*hasRecipe = 0;
+	else
+		return 0;
+	return 1;
+}
+
+// write an argument of the given type (a descriptor character)
+static void writeConcatArg(StringWriter *w, char type, Var *arg) {
+	char buf[32];
+
+	switch (type) {
+		case 'Z':
+			if (arg->intValue != 0)
+				writeUtf(w, "true", 4);
+			else
+				writeUtf(w, "false", 5);
+			break;
+		case 'C':
+			writeChar(w, (unsigned short)arg->intValue);
+			break;
+		case 'J':
+			utils_lltoa(getInt64(arg), buf, 10);
+			writeUtf(w, buf, strlen(buf));
+			break;
+		case 'F':
+			utils_dtoa(arg->floatValue, buf, 1);
+			writeUtf(w, buf, strlen(buf));
+			break;
+		case 'D':
+			utils_dtoa(getFloat64(arg), buf, 0);
+			writeUtf(w, buf, strlen(buf));
+			break;
+		case 'L':
+		case '[':
+			// objects were turned into strings before
+			if (arg->obj == WOBJECT_NULL)
+				writeUtf(w, "null", 4);
+			else
+				writeString(w, arg->obj);
+			break;
+		default:
+			utils_ltoa(arg->intValue, buf, 10);
+			writeUtf(w, buf, strlen(buf));
+			break;
+	}
+}
+
+static void writeConcatConstant(StringWriter *w, WClass *wclass, unsigned short idx) {
+	UtfString s;
+	char buf[32];
+
+	if (CONS_tag(wclass, idx) == CONSTANT_String) {
+		s = getUtfString(wclass, CONS_stringIndex(wclass, idx));
+		writeUtf(w, s.str, s.len);
+	}
+	else if (CONS_tag(wclass, idx) == CONSTANT_Integer) {
+		utils_ltoa(CONS_integer(wclass, idx), buf, 10);
+		writeUtf(w, buf, strlen(buf));
+	}
+	else if (CONS_tag(wclass, idx) == CONSTANT_Long) {
+		utils_lltoa(CONS_long(wclass, idx), buf, 10);
+		writeUtf(w, buf, strlen(buf));
+	}
+	else if (CONS_tag(wclass, idx) == CONSTANT_Float) {
+		utils_dtoa(CONS_float(wclass, idx), buf, 1);
+		writeUtf(w, buf, strlen(buf));
+	}
+	else if (CONS_tag(wclass, idx) == CONSTANT_Double) {
+		utils_dtoa(CONS_double(wclass, idx), buf, 0);
+		writeUtf(w, buf, strlen(buf));
+	}
+}
+
+// Concatenate the arguments of the invokedynamic at constant idx, the
+// arguments are the top of the stack. Returns the number of stack
+// entries the arguments take (retValue is the String or an exception
+// depending on retType) or -1 on a fatal error.
+static long concatStrings(WClass *wclass, unsigned short idx, Var *stack, unsigned char *retType, Var *retValue) {
+	unsigned char *bsm;
+	UtfString desc, recipe;
+	StringWriter w;
+	WClass *vclass;
+	WClassMethod *toString;
+	Var *args[CONCAT_MAX_ARGS], v;
+	char types[CONCAT_MAX_ARGS];
+	unsigned long numArgs, numSlots, i, j, k;
+	int hasRecipe, pass;
+	unsigned char vType;
+
+	recipe.str = NULL;
+	recipe.len = 0;
+	if (CONS_tag(wclass, idx) != CONSTANT_InvokeDynamic ||
+		CONS_bootstrapIndex(wclass, idx) >= wclass->numBootstrapMethods)
+		goto bad_bootstrap;
+	bsm = wclass->bootstrapMethods[CONS_bootstrapIndex(wclass, idx)];
+	if (!isConcatBootstrap(wclass, bsm, &hasRecipe))
+		goto bad_bootstrap;
+	if (hasRecipe) {
+		if (BSM_numArgs(bsm) < 1 || CONS_tag(wclass, BSM_arg(bsm, 0)) != CONSTANT_String)
+			goto bad_bootstrap;
+		recipe = getUtfString(wclass, CONS_stringIndex(wclass, BSM_arg(bsm, 0)));
+	}
+
+	// the argument types from the call site descriptor
+	desc = getUtfString(wclass, CONS_typeIndex(wclass, CONS_nameAndTypeIndex(wclass, idx)));
+	numArgs = 0;
+	numSlots = 0;
+	for (i = 1; i < desc.len && desc.str[i] != ')'; i++) {
+		if (numArgs == CONCAT_MAX_ARGS)
+			goto bad_bootstrap;
+		types[numArgs++] = desc.str[i];
+		numSlots += (desc.str[i] == 'J' || desc.str[i] == 'D') ? 2 : 1;
+		while (desc.str[i] == '[')
+			i++;
+		if (desc.str[i] == 'L') {
+			while (i < desc.len && desc.str[i] != ';')
+				i++;
+		}
+	}
+	// a long or double argument takes two stack entries
+	for (i = 0; i < numArgs; i++)
+		args[i] = (i == 0) ? stack - numSlots :
+			args[i - 1] + ((types[i - 1] == 'J' || types[i - 1] == 'D') ? 2 : 1);
+
+	// turn the objects into strings first since toString() may run code
+	for (i = 0; i < numArgs; i++) {
+		if ((types[i] != 'L' && types[i] != '[') || args[i]->obj == WOBJECT_NULL)
+			continue;
+		if (WOBJ_class(args[i]->obj) == stringClass)
+			continue;
+		if (WOBJ_isArray(args[i]->obj)) {
+			// arrays have no class, write them like Object.toString() of Java
+			char buf[24];
+
+			buf[0] = '[';
+			buf[1] = "?L[?ZCFDBSIJ"[WOBJ_arrayType(args[i]->obj) <= TYPE_LONG ? WOBJ_arrayType(args[i]->obj) : 0];
+			buf[2] = '@';
+			utils_ltoa((long)args[i]->obj, &buf[3], 16);
+			args[i]->obj = createString(buf);
+			if (args[i]->obj == WOBJECT_NULL)
+				return -1;
+			continue;
+		}
+		toString = getMethod(WOBJ_class(args[i]->obj), createUtfString("toString"),
+			createUtfString("()Ljava/lang/String;"), &vclass);
+		if (toString == NULL) {
+			VmSetFatalErrorNum(ERR_CantFindMethod);
+			return -1;
+		}
+		v = *args[i];
+		executeMethod(vclass, toString, &v, 1, &vType, &v);
+		if (vmStatus.type == TYPE_FATAL_ERROR)
+			return -1;
+		if (vType == RET_TYPE_EXCEPTION) {
+			*retType = RET_TYPE_EXCEPTION;
+			*retValue = v;
+			return (long)numSlots;
+		}
+		args[i]->obj = v.obj;
+	}
+
+	initStringWriter(&w);
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 1 && beginStringWrite(&w) != FT_ERR_OK)
+			return -1;
+		if (!hasRecipe) {
+			for (i = 0; i < numArgs; i++)
+				writeConcatArg(&w, types[i], args[i]);
+			continue;
+		}
+		j = 0; // next argument
+		k = 1; // next constant
+		for (i = 0; i < recipe.len; ) {
+			if (recipe.str[i] == CONCAT_ARG) {
+				if (j < numArgs) {
+					writeConcatArg(&w, types[j], args[j]);
+					j++;
+				}
+				i++;
+			}
+			else if (recipe.str[i] == CONCAT_CONSTANT) {
+				if (k < BSM_numArgs(bsm))
+					writeConcatConstant(&w, wclass, BSM_arg(bsm, k++));
+				i++;
+			}
+			else {
+				unsigned long start = i;
+
+				while (i < recipe.len && recipe.str[i] != CONCAT_ARG && recipe.str[i] != CONCAT_CONSTANT)
+					i++;
+				writeUtf(&w, &recipe.str[start], i - start);
+			}
+		}
+	}
+	retValue->obj = endStringWrite(&w);
+	if (retValue->obj == WOBJECT_NULL)
+		return -1;
+	*retType = RET_TYPE_RETURN;
+	return (long)numSlots;
+
+bad_bootstrap:
+	VmSetFatalErrorNum(ERR_BadOpcode);
+	return -1;
+}
+
+// float to int and long like Java: NaN gives 0 and values out of range
+// give the smallest or the largest value (C leaves these undefined)
+static long float64ToInt(float64 value) {
+	if (value != value)
+		return 0;
+	if (value >= 2147483647.0)
+		return 0x7FFFFFFFL;
+	if (value <= -2147483648.0)
+		return -0x7FFFFFFFL - 1;
+	return (long)value;
+}
+
+static int64 float64ToLong(float64 value) {
+	if (value != value)
+		return 0;
+	if (value >= 9223372036854775807.0)
+		return 0x7FFFFFFFFFFFFFFFLL;
+	if (value <= -9223372036854775808.0)
+		return -0x7FFFFFFFFFFFFFFFLL - 1;
+	return (int64)value;
+}
+
+// an int result wrapped to 32 bits like Java. intValue is a long, which
+// has 64 bits on LP64 hosts; the arithmetic is done unsigned so it is
+// defined in C when it overflows
+#define INT32(v)	((long)(int)(unsigned long)(v))
+
+// fcmpl/fcmpg/dcmpl/dcmpg, only differ in the result for NaN
+static long compareFloat64(float64 a, float64 b, long nanResult) {
+	if (a > b)
+		return 1;
+	if (a < b)
+		return -1;
+	if (a == b)
+		return 0;
+	return nanResult;
+}
+
+// the least number of params of a native method frame, see method_invoke
+#define NATIVE_MIN_VARS 2
+
+// NOTE: retValue must have room for two Vars if the method returns a long
+// or a double
+long executeMethod(WClass *wclass, WClassMethod *method, Var params[], unsigned short numParams, unsigned char *retType, Var* callerRetValue) {
+	Var retValues[2];
+	Var *retValue;
 	Var *var;
 	Var *stack;
 	unsigned char *pc;
@@ -1363,6 +1991,8 @@ long executeMethod(WClass *wclass, WClassMethod *method, Var params[], unsigned
 	// is why we exit when we keep trace of the baseFramePtr.
 
 	*retType = RET_TYPE_NONE;
+	retValue = retValues; // copied to callerRetValue when done
+	retValues[0].obj = WOBJECT_NULL;
 	baseFramePtr = vmStackPtr;
 
 	curwclass = wclass;
@@ -1378,7 +2008,7 @@ long executeMethod(WClass *wclass, WClassMethod *method, Var params[], unsigned
 	if (METH_isNative(curmethod)) {
 		if (curmethod->code.nativeFunc == NULL)
 			goto bad_class_code_fatal_error;
-		if (vmStackPtr + numParams + 1 + 3 >= vmStackSize)
+		if (vmStackPtr + numParams + NATIVE_MIN_VARS + 1 + 3 >= vmStackSize)
 			goto stack_overflow_fatal_error;
 	} else {
 		if (curmethod->code.codeAttr == NULL)
@@ -1404,23 +2034,24 @@ method_invoke:
 		// stack(base)
 		// method pointer
 		// class pointer
+		//
+		// The native returns its value in stack[0] (and stack[1] for a
+		// long) so there are at least NATIVE_MIN_VARS params.
+		if (numParams < NATIVE_MIN_VARS)
+			numParams = NATIVE_MIN_VARS;
 		stack = &vmStack[vmStackPtr];
 		vmStackPtr += numParams;
 		vmStack[vmStackPtr++].intValue = numParams;
 		vmStack[vmStackPtr++].refValue = stack;
 		vmStack[vmStackPtr++].refValue = curmethod;
 		vmStack[vmStackPtr++].refValue = curwclass;
-		
-		if( numParams == 0 ){
-			// must numParams >= 1
-			VmSetFatalErrorNum(ERR_NativeErrorReturn);
-			goto fatal_error;
-		}
 
 		ret = curmethod->code.nativeFunc( stack );
 		if( ret == 0 ){
 			if (curmethod->returnsValue){
-				*retValue = stack[0];
+				retValue[0] = stack[0];
+				if (curmethod->returnsWide)
+					retValue[1] = stack[1];
 				*retType = RET_TYPE_RETURN;
 			}else{
 				*retType = RET_TYPE_NONE;
@@ -1456,28 +2087,32 @@ method_invoke:
 	vmStack[vmStackPtr++].refValue = curwclass;
 	pc = METH_code(curmethod);
 
-step:
+	goto step;
+
+	// Everything that throws jumps here with the exception in retValue
+	// so the instructions don't have to check for one
+throw_exception:
 	if( vmStatus.type == TYPE_FATAL_ERROR )
 		goto method_return;
+	{
+		WClassHandler *handler;
 
-	if(*retType == RET_TYPE_EXCEPTION) {
-		for( i = 0 ; i < curmethod->numHandlers; i++ ){
-			WClassHandler* handler = &(curmethod->handlers)[i];
-			if( ( METH_code( curmethod ) + handler->start_pc <= pc ) && ( pc <= METH_code( curmethod ) + handler->end_pc ) ){
-				if( compatible( WOBJ_class( retValue->obj ), getClassByIndex( curwclass, handler->catch_type ) ) ){
-					pc = METH_code( curmethod ) + handler->handler_pc;
-					// reset stack(base)
-					stack = (Var *)vmStack[vmStackPtr - 3].refValue;
-					stack[0] = *retValue;
-					stack++;
-					*retType = RET_TYPE_NONE;
-					goto step;
-				}
-			}
-		}
+		handler = findHandler(curwclass, curmethod, (unsigned long)(pc - METH_code(curmethod)),
+			WOBJ_class(retValue->obj));
+		if (handler == NULL)
+			goto method_return;
+		pc = METH_code(curmethod) + handler->handler_pc;
+		// reset stack(base)
+		stack = (Var *)vmStack[vmStackPtr - 3].refValue;
+		stack[0] = *retValue;
+		stack++;
+		*retType = RET_TYPE_NONE;
+	}
+
+step:
+	if( vmStatus.type == TYPE_FATAL_ERROR )
 		goto method_return;
 
-	}
 	switch (*pc) {
 		case OP_nop:
 			pc++;
@@ -1521,6 +2156,7 @@ step:
 			pc += 3;
 			break;
 		case OP_iload:
+		case OP_fload:
 		case OP_aload:
 			*stack = var[pc[1]];
 			stack++;
@@ -1542,6 +2178,14 @@ step:
 			stack++;
 			pc++;
 			break;
+		case OP_fload_0:
+		case OP_fload_1:
+		case OP_fload_2:
+		case OP_fload_3:
+			*stack = var[*pc - OP_fload_0];
+			stack++;
+			pc++;
+			break;
 		case OP_iaload:
 			obj = stack[-2].obj;
 			i = stack[-1].intValue;
@@ -1594,6 +2238,7 @@ step:
 			break;
 		case OP_astore:
 		case OP_istore:
+		case OP_fstore:
 			stack--;
 			var[pc[1]] = *stack;
 			pc += 2;
@@ -1614,6 +2259,14 @@ step:
 			var[*pc - OP_astore_0] = *stack;
 			pc++;
 			break;
+		case OP_fstore_0:
+		case OP_fstore_1:
+		case OP_fstore_2:
+		case OP_fstore_3:
+			stack--;
+			var[*pc - OP_fstore_0] = *stack;
+			pc++;
+			break;
 		case OP_iastore:
 			obj = stack[-3].obj;
 			i = stack[-2].intValue;
@@ -1730,59 +2383,57 @@ step:
 			break;
 			}
 		case OP_iadd:
-			stack[-2].intValue += stack[-1].intValue;
+			stack[-2].intValue = INT32((unsigned long)stack[-2].intValue + (unsigned long)stack[-1].intValue);
 			stack--;
 			pc++;
 			break;
 		case OP_isub:
-			stack[-2].intValue -= stack[-1].intValue;
+			stack[-2].intValue = INT32((unsigned long)stack[-2].intValue - (unsigned long)stack[-1].intValue);
 			stack--;
 			pc++;
 			break;
 		case OP_imul:
-			stack[-2].intValue *= stack[-1].intValue;
+			stack[-2].intValue = INT32((unsigned long)stack[-2].intValue * (unsigned long)stack[-1].intValue);
 			stack--;
 			pc++;
 			break;
 		case OP_idiv:
 			if (stack[-1].intValue == 0)
 				goto div_by_zero_error;
-			stack[-2].intValue /= stack[-1].intValue;
+			// the most negative value divided by -1 overflows in C
+			if (stack[-1].intValue == -1)
+				stack[-2].intValue = INT32(0 - (unsigned long)stack[-2].intValue);
+			else
+				stack[-2].intValue /= stack[-1].intValue;
 			stack--;
 			pc++;
 			break;
 		case OP_irem:
 			if (stack[-1].intValue == 0)
 				goto div_by_zero_error;
-			stack[-2].intValue = stack[-2].intValue % stack[-1].intValue;
+			if (stack[-1].intValue == -1)
+				stack[-2].intValue = 0;
+			else
+				stack[-2].intValue = stack[-2].intValue % stack[-1].intValue;
 			stack--;
 			pc++;
 			break;
 		case OP_ineg:
-			stack[-1].intValue = - stack[-1].intValue;
+			stack[-1].intValue = INT32(0 - (unsigned long)stack[-1].intValue);
 			pc++;
 			break;
 		case OP_ishl:
-			stack[-2].intValue = stack[-2].intValue << stack[-1].intValue;
+			stack[-2].intValue = INT32((unsigned long)stack[-2].intValue << (stack[-1].intValue & 0x1F));
 			stack--;
 			pc++;
 			break;
 		case OP_ishr:
-			stack[-2].intValue = stack[-2].intValue >> stack[-1].intValue;
+			stack[-2].intValue = stack[-2].intValue >> (stack[-1].intValue & 0x1F);
 			stack--;
 			pc++;
 			break;
 		case OP_iushr:
-			i = stack[-1].intValue;
-			if (stack[-2].intValue >= 0)
-				stack[-2].intValue = stack[-2].intValue >> i;
-			else {
-				stack[-2].intValue = stack[-2].intValue >> i;
-				if (i >= 0)
-					stack[-2].intValue += (long)2 << (31 - i);
-				else
-					stack[-2].intValue += (long)2 << ((- i) + 1);
-			}
+			stack[-2].intValue = INT32((unsigned int)stack[-2].intValue >> (stack[-1].intValue & 0x1F));
 			stack--;
 			pc++;
 			break;
@@ -1802,11 +2453,11 @@ step:
 			pc++;
 			break;
 		case OP_iinc:
-			var[pc[1]].intValue += (char)pc[2];
+			var[pc[1]].intValue = INT32((unsigned long)var[pc[1]].intValue + (signed char)pc[2]);
 			pc += 3;
 			break;
 		case OP_i2b:
-			stack[-1].intValue = (long)((char)(stack[-1].intValue & 0xFF));
+			stack[-1].intValue = (long)((signed char)(stack[-1].intValue & 0xFF));
 			pc++;
 			break;
 		case OP_i2c:
@@ -1817,6 +2468,338 @@ step:
 			stack[-1].intValue = (long)((short)(stack[-1].intValue & 0xFFFF));
 			pc++;
 			break;
+		// long values take two Vars, see getInt64()
+		case OP_lconst_0:
+		case OP_lconst_1:
+			setInt64(stack, (int64)(*pc - OP_lconst_0));
+			stack += 2;
+			pc++;
+			break;
+		case OP_ldc2_w:
+			i = utils_get_uint16b(&pc[1]);
+			if (CONS_tag(curwclass, i) != CONSTANT_Long && CONS_tag(curwclass, i) != CONSTANT_Double) {
+				VmSetFatalErrorNum(ERR_ConstantToVar);
+				goto fatal_error;
+			}
+			// a double is pushed by its bits like a long
+			setInt64(stack, CONS_long(curwclass, i));
+			stack += 2;
+			pc += 3;
+			break;
+		case OP_lload:
+		case OP_dload:
+			stack[0] = var[pc[1]];
+			stack[1] = var[pc[1] + 1];
+			stack += 2;
+			pc += 2;
+			break;
+		case OP_lload_0:
+		case OP_lload_1:
+		case OP_lload_2:
+		case OP_lload_3:
+			stack[0] = var[*pc - OP_lload_0];
+			stack[1] = var[*pc - OP_lload_0 + 1];
+			stack += 2;
+			pc++;
+			break;
+		case OP_lstore:
+		case OP_dstore:
+			var[pc[1]] = stack[-2];
+			var[pc[1] + 1] = stack[-1];
+			stack -= 2;
+			pc += 2;
+			break;
+		case OP_lstore_0:
+		case OP_lstore_1:
+		case OP_lstore_2:
+		case OP_lstore_3:
+			var[*pc - OP_lstore_0] = stack[-2];
+			var[*pc - OP_lstore_0 + 1] = stack[-1];
+			stack -= 2;
+			pc++;
+			break;
+		// doubles are copied by their bits like longs
+		case OP_laload:
+		case OP_daload:
+			obj = stack[-2].obj;
+			i = stack[-1].intValue;
+			if (obj == WOBJECT_NULL) goto null_array_error;
+			objPtr = objectPtr(obj);
+			if (i < 0 || i >= WOBJ_arrayLenP(objPtr)) goto index_range_error;
+			setInt64(&stack[-2], getInt64((unsigned char *)WOBJ_arrayStartP(objPtr) + i * sizeof(int64)));
+			pc++;
+			break;
+		case OP_lastore:
+		case OP_dastore:
+			obj = stack[-4].obj;
+			i = stack[-3].intValue;
+			if (obj == WOBJECT_NULL) goto null_array_error;
+			objPtr = objectPtr(obj);
+			if (i < 0 || i >= WOBJ_arrayLenP(objPtr)) goto index_range_error;
+			setInt64((unsigned char *)WOBJ_arrayStartP(objPtr) + i * sizeof(int64), getInt64(&stack[-2]));
+			stack -= 4;
+			pc++;
+			break;
+		// the arithmetic is done unsigned so it wraps around like Java
+		case OP_ladd:
+			setInt64(&stack[-4], (int64)((uint64)getInt64(&stack[-4]) + (uint64)getInt64(&stack[-2])));
+			stack -= 2;
+			pc++;
+			break;
+		case OP_lsub:
+			setInt64(&stack[-4], (int64)((uint64)getInt64(&stack[-4]) - (uint64)getInt64(&stack[-2])));
+			stack -= 2;
+			pc++;
+			break;
+		case OP_lmul:
+			setInt64(&stack[-4], (int64)((uint64)getInt64(&stack[-4]) * (uint64)getInt64(&stack[-2])));
+			stack -= 2;
+			pc++;
+			break;
+		case OP_ldiv:
+		case OP_lrem:
+			{
+			int64 a, b;
+
+			a = getInt64(&stack[-4]);
+			b = getInt64(&stack[-2]);
+			if (b == 0)
+				goto div_by_zero_error;
+			// the most negative value divided by -1 overflows in C
+			if (*pc == OP_ldiv)
+				a = (b == -1) ? (int64)(0 - (uint64)a) : a / b;
+			else
+				a = (b == -1) ? 0 : a % b;
+			setInt64(&stack[-4], a);
+			stack -= 2;
+			pc++;
+			break;
+			}
+		case OP_lneg:
+			setInt64(&stack[-2], (int64)(0 - (uint64)getInt64(&stack[-2])));
+			pc++;
+			break;
+		case OP_lshl:
+			setInt64(&stack[-3], (int64)((uint64)getInt64(&stack[-3]) << (stack[-1].intValue & 0x3F)));
+			stack--;
+			pc++;
+			break;
+		case OP_lshr:
+			setInt64(&stack[-3], getInt64(&stack[-3]) >> (stack[-1].intValue & 0x3F));
+			stack--;
+			pc++;
+			break;
+		case OP_lushr:
+			setInt64(&stack[-3], (int64)((uint64)getInt64(&stack[-3]) >> (stack[-1].intValue & 0x3F)));
+			stack--;
+			pc++;
+			break;
+		case OP_land:
+			setInt64(&stack[-4], getInt64(&stack[-4]) & getInt64(&stack[-2]));
+			stack -= 2;
+			pc++;
+			break;
+		case OP_lor:
+			setInt64(&stack[-4], getInt64(&stack[-4]) | getInt64(&stack[-2]));
+			stack -= 2;
+			pc++;
+			break;
+		case OP_lxor:
+			setInt64(&stack[-4], getInt64(&stack[-4]) ^ getInt64(&stack[-2]));
+			stack -= 2;
+			pc++;
+			break;
+		case OP_i2l:
+			setInt64(&stack[-1], (int64)stack[-1].intValue);
+			stack++;
+			pc++;
+			break;
+		case OP_l2i:
+			stack[-2].intValue = (long)(int)getInt64(&stack[-2]);
+			stack--;
+			pc++;
+			break;
+		case OP_lcmp:
+			{
+			int64 a, b;
+
+			a = getInt64(&stack[-4]);
+			b = getInt64(&stack[-2]);
+			stack[-4].intValue = (a > b) ? 1 : ((a < b) ? -1 : 0);
+			stack -= 3;
+			pc++;
+			break;
+			}
+		case OP_fconst_0:
+		case OP_fconst_1:
+		case OP_fconst_2:
+			stack[0].floatValue = (float32)(*pc - OP_fconst_0);
+			stack++;
+			pc++;
+			break;
+		case OP_dconst_0:
+		case OP_dconst_1:
+			setFloat64(stack, (float64)(*pc - OP_dconst_0));
+			stack += 2;
+			pc++;
+			break;
+		case OP_dload_0:
+		case OP_dload_1:
+		case OP_dload_2:
+		case OP_dload_3:
+			stack[0] = var[*pc - OP_dload_0];
+			stack[1] = var[*pc - OP_dload_0 + 1];
+			stack += 2;
+			pc++;
+			break;
+		case OP_dstore_0:
+		case OP_dstore_1:
+		case OP_dstore_2:
+		case OP_dstore_3:
+			var[*pc - OP_dstore_0] = stack[-2];
+			var[*pc - OP_dstore_0 + 1] = stack[-1];
+			stack -= 2;
+			pc++;
+			break;
+		case OP_faload:
+			obj = stack[-2].obj;
+			i = stack[-1].intValue;
+			if (obj == WOBJECT_NULL) goto null_array_error;
+			objPtr = objectPtr(obj);
+			if (i < 0 || i >= WOBJ_arrayLenP(objPtr)) goto index_range_error;
+			stack[-2].floatValue = ((float32 *)WOBJ_arrayStartP(objPtr))[i];
+			stack--;
+			pc++;
+			break;
+		case OP_fastore:
+			obj = stack[-3].obj;
+			i = stack[-2].intValue;
+			if (obj == WOBJECT_NULL) goto null_array_error;
+			objPtr = objectPtr(obj);
+			if (i < 0 || i >= WOBJ_arrayLenP(objPtr)) goto index_range_error;
+			((float32 *)WOBJ_arrayStartP(objPtr))[i] = stack[-1].floatValue;
+			stack -= 3;
+			pc++;
+			break;
+		case OP_fadd:
+			stack[-2].floatValue += stack[-1].floatValue;
+			stack--;
+			pc++;
+			break;
+		case OP_fsub:
+			stack[-2].floatValue -= stack[-1].floatValue;
+			stack--;
+			pc++;
+			break;
+		case OP_fmul:
+			stack[-2].floatValue *= stack[-1].floatValue;
+			stack--;
+			pc++;
+			break;
+		case OP_fdiv:
+			// no exception, division by zero gives an infinity or NaN
+			stack[-2].floatValue /= stack[-1].floatValue;
+			stack--;
+			pc++;
+			break;
+		case OP_frem:
+			stack[-2].floatValue = fmodf(stack[-2].floatValue, stack[-1].floatValue);
+			stack--;
+			pc++;
+			break;
+		case OP_fneg:
+			stack[-1].floatValue = -stack[-1].floatValue;
+			pc++;
+			break;
+		case OP_dadd:
+			setFloat64(&stack[-4], getFloat64(&stack[-4]) + getFloat64(&stack[-2]));
+			stack -= 2;
+			pc++;
+			break;
+		case OP_dsub:
+			setFloat64(&stack[-4], getFloat64(&stack[-4]) - getFloat64(&stack[-2]));
+			stack -= 2;
+			pc++;
+			break;
+		case OP_dmul:
+			setFloat64(&stack[-4], getFloat64(&stack[-4]) * getFloat64(&stack[-2]));
+			stack -= 2;
+			pc++;
+			break;
+		case OP_ddiv:
+			setFloat64(&stack[-4], getFloat64(&stack[-4]) / getFloat64(&stack[-2]));
+			stack -= 2;
+			pc++;
+			break;
+		case OP_drem:
+			setFloat64(&stack[-4], fmod(getFloat64(&stack[-4]), getFloat64(&stack[-2])));
+			stack -= 2;
+			pc++;
+			break;
+		case OP_dneg:
+			setFloat64(&stack[-2], -getFloat64(&stack[-2]));
+			pc++;
+			break;
+		case OP_i2f:
+			stack[-1].floatValue = (float32)stack[-1].intValue;
+			pc++;
+			break;
+		case OP_i2d:
+			setFloat64(&stack[-1], (float64)stack[-1].intValue);
+			stack++;
+			pc++;
+			break;
+		case OP_l2f:
+			stack[-2].floatValue = (float32)getInt64(&stack[-2]);
+			stack--;
+			pc++;
+			break;
+		case OP_l2d:
+			setFloat64(&stack[-2], (float64)getInt64(&stack[-2]));
+			pc++;
+			break;
+		case OP_f2i:
+			stack[-1].intValue = float64ToInt(stack[-1].floatValue);
+			pc++;
+			break;
+		case OP_f2l:
+			setInt64(&stack[-1], float64ToLong(stack[-1].floatValue));
+			stack++;
+			pc++;
+			break;
+		case OP_f2d:
+			setFloat64(&stack[-1], (float64)stack[-1].floatValue);
+			stack++;
+			pc++;
+			break;
+		case OP_d2i:
+			stack[-2].intValue = float64ToInt(getFloat64(&stack[-2]));
+			stack--;
+			pc++;
+			break;
+		case OP_d2l:
+			setInt64(&stack[-2], float64ToLong(getFloat64(&stack[-2])));
+			pc++;
+			break;
+		case OP_d2f:
+			stack[-2].floatValue = (float32)getFloat64(&stack[-2]);
+			stack--;
+			pc++;
+			break;
+		case OP_fcmpl:
+		case OP_fcmpg:
+			stack[-2].intValue = compareFloat64(stack[-2].floatValue, stack[-1].floatValue,
+				(*pc == OP_fcmpl) ? -1 : 1);
+			stack--;
+			pc++;
+			break;
+		case OP_dcmpl:
+		case OP_dcmpg:
+			stack[-4].intValue = compareFloat64(getFloat64(&stack[-4]), getFloat64(&stack[-2]),
+				(*pc == OP_dcmpl) ? -1 : 1);
+			stack -= 3;
+			pc++;
+			break;
 		case OP_ifeq:
 			if (stack[-1].intValue == 0)
 				pc += utils_get_int16b(&pc[1]);
@@ -1987,16 +2970,24 @@ step:
 			break;
 			}
 		case OP_ireturn:
+		case OP_freturn:
 		case OP_areturn:
 			*retValue = stack[-1];
 			*retType = RET_TYPE_RETURN;
 			goto method_return;
+		case OP_lreturn:
+		case OP_dreturn:
+			retValue[0] = stack[-2];
+			retValue[1] = stack[-1];
+			*retType = RET_TYPE_RETURN;
+			goto method_return;
 		case OP_return:
 			*retType = RET_TYPE_NONE;
 			goto method_return;
 		case OP_getfield:
 			{
 			WClassField *field;
+			unsigned char *varPtr;
 
 			field = getFieldByIndex(curwclass, utils_get_uint16b(&pc[1]), NULL);
 			if (field == NULL)
@@ -2004,21 +2995,81 @@ step:
 			obj = stack[-1].obj;
 			if (obj == WOBJECT_NULL)
 				goto null_obj_error;
-			stack[-1] = WOBJ_var(obj, field->var.varOffset);
+			// object variables are packed, read as much as the type takes
+			varPtr = WOBJ_field(obj, field->var.varOffset);
+			switch (field->type) {
+				case TYPE_OBJECT:
+				case TYPE_ARRAY:
+					stack[-1].obj = *(WObject *)varPtr;
+					break;
+				case TYPE_INT:
+				case TYPE_FLOAT:
+					stack[-1].intValue = *(long *)varPtr;
+					break;
+				case TYPE_SHORT:
+					stack[-1].intValue = (long)*(short *)varPtr;
+					break;
+				case TYPE_CHAR:
+					stack[-1].intValue = (long)*(unsigned short *)varPtr;
+					break;
+				case TYPE_BOOLEAN:
+				case TYPE_BYTE:
+					stack[-1].intValue = (long)*(char *)varPtr;
+					break;
+				case TYPE_LONG:
+				case TYPE_DOUBLE:
+					setInt64(&stack[-1], getInt64(varPtr));
+					stack++;
+					break;
+				default:
+					stack[-1] = *(Var *)varPtr;
+					break;
+			}
 			pc += 3;
 			break;
 			}
 		case OP_putfield:
 			{
 			WClassField *field;
+			unsigned char *varPtr;
 
 			field = getFieldByIndex(curwclass, utils_get_uint16b(&pc[1]), NULL);
 			if (field == NULL)
 				goto fatal_error;
+			if (field->type == TYPE_LONG || field->type == TYPE_DOUBLE) {
+				obj = stack[-3].obj;
+				if (obj == WOBJECT_NULL)
+					goto null_obj_error;
+				setInt64(WOBJ_field(obj, field->var.varOffset), getInt64(&stack[-2]));
+				stack -= 3;
+				pc += 3;
+				break;
+			}
 			obj = stack[-2].obj;
 			if (obj == WOBJECT_NULL)
 				goto null_obj_error;
-			WOBJ_var(obj, field->var.varOffset) = stack[-1];
+			varPtr = WOBJ_field(obj, field->var.varOffset);
+			switch (field->type) {
+				case TYPE_OBJECT:
+				case TYPE_ARRAY:
+					*(WObject *)varPtr = stack[-1].obj;
+					break;
+				case TYPE_INT:
+				case TYPE_FLOAT:
+					*(long *)varPtr = stack[-1].intValue;
+					break;
+				case TYPE_SHORT:
+				case TYPE_CHAR:
+					*(short *)varPtr = (short)stack[-1].intValue;
+					break;
+				case TYPE_BOOLEAN:
+				case TYPE_BYTE:
+					*(char *)varPtr = (char)stack[-1].intValue;
+					break;
+				default:
+					*(Var *)varPtr = stack[-1];
+					break;
+			}
 			stack -= 2;
 			pc += 3;
 			break;
@@ -2031,8 +3082,15 @@ step:
 			field = getFieldByIndex(curwclass, utils_get_uint16b(&pc[1]), &vclass);
 			if (field == NULL)
 				goto fatal_error;
-			stack[0] = field->var.staticVar;
-			stack++;
+			if (field->type == TYPE_LONG || field->type == TYPE_DOUBLE) {
+				stack[0] = field->var.staticVars[0];
+				stack[1] = field->var.staticVars[1];
+				stack += 2;
+			}
+			else {
+				stack[0] = field->var.staticVar;
+				stack++;
+			}
 			pc += 3;
 			break;
 			}
@@ -2044,8 +3102,15 @@ step:
 			field = getFieldByIndex(curwclass, utils_get_uint16b(&pc[1]), &vclass);
 			if (field == NULL)
 				goto fatal_error;
-			field->var.staticVar = stack[-1];
-			stack--;
+			if (field->type == TYPE_LONG || field->type == TYPE_DOUBLE) {
+				field->var.staticVars[0] = stack[-2];
+				field->var.staticVars[1] = stack[-1];
+				stack -= 2;
+			}
+			else {
+				field->var.staticVar = stack[-1];
+				stack--;
+			}
 			pc += 3;
 			break;
 			}
@@ -2062,21 +3127,38 @@ step:
 			break;
 			}
 		case OP_newarray:
-			if( stack[-1].intValue < 0 )
-				goto negative_array_size_error;
-			stack[-1].obj = createArrayObject(pc[1], stack[-1].intValue);
-			if( stack[-1].obj == WOBJECT_NULL )
-				goto out_of_objectmem_fatal_error;
-			pc += 2;
-			break;
 		case OP_anewarray:
-			if( stack[-1].intValue < 0 )
+			{
+			unsigned char type;
+
+			i = stack[-1].intValue;
+			if( i < 0 )
 				goto negative_array_size_error;
-			stack[-1].obj = createArrayObject(TYPE_OBJECT, stack[-1].intValue);
-			if( stack[-1].obj == WOBJECT_NULL )
+			// checked before the fast path, arraySize() can wrap around
+			// for a length that doesn't fit in the header
+			if( i > ARRAY_MAX_LEN )
 				goto out_of_objectmem_fatal_error;
-			pc += 3;
+			if (*pc == OP_newarray)
+				type = pc[1];
+			else
+				type = TYPE_OBJECT;
+			// inline allocation fast path, createArrayObject() takes
+			// over when the allocation buffer is used up
+			obj = allocObjectFast(arraySize(type, i));
+			if (obj != WOBJECT_NULL) {
+				WOBJ_setArrayHeader(obj, type, i);
+			} else {
+				obj = createArrayObject(type, i);
+				if( obj == WOBJECT_NULL )
+					goto out_of_objectmem_fatal_error;
+			}
+			stack[-1].obj = obj;
+			if (*pc == OP_newarray)
+				pc += 2;
+			else
+				pc += 3;
 			break;
+			}
 		case OP_arraylength:
 			obj = stack[-1].obj;
 			if (obj == WOBJECT_NULL)
@@ -2126,6 +3208,7 @@ step:
 			pc++;
 			switch (*pc) {
 				case OP_iload:
+				case OP_fload:
 				case OP_aload:
 					stack[0] = var[utils_get_uint16b(&pc[1])];
 					stack++;
@@ -2133,12 +3216,28 @@ step:
 					break;
 				case OP_astore:
 				case OP_istore:
+				case OP_fstore:
 					var[utils_get_uint16b(&pc[1])] = stack[-1];
 					stack--;
 					pc += 3;
 					break;
+				case OP_lload:
+				case OP_dload:
+					stack[0] = var[utils_get_uint16b(&pc[1])];
+					stack[1] = var[utils_get_uint16b(&pc[1]) + 1];
+					stack += 2;
+					pc += 3;
+					break;
+				case OP_lstore:
+				case OP_dstore:
+					var[utils_get_uint16b(&pc[1])] = stack[-2];
+					var[utils_get_uint16b(&pc[1]) + 1] = stack[-1];
+					stack -= 2;
+					pc += 3;
+					break;
 				case OP_iinc:
-					var[utils_get_uint16b(&pc[1])].intValue += utils_get_int16b(&pc[3]);
+					i = utils_get_uint16b(&pc[1]);
+					var[i].intValue = INT32((unsigned long)var[i].intValue + utils_get_int16b(&pc[3]));
 					pc += 5;
 					break;
 				case OP_ret:
@@ -2199,10 +3298,12 @@ step:
 			pc++;
 			break;
 		case OP_athrow:
+			if (stack[-1].obj == WOBJECT_NULL)
+				goto null_obj_error;
 			pc++;
 			*retValue = stack[-1];
 			*retType = RET_TYPE_EXCEPTION;
-			break;
+			goto throw_exception;
 		case OP_invokeinterface:
 		case OP_invokestatic:
 		case OP_invokevirtual:
@@ -2291,6 +3392,27 @@ step:
 				iparams = imethod->numParams;
 			}
 
+			// a leaf native runs on the operand stack and returns its value
+			// in place of the params, there is no frame to push or pop
+			if (imethod->isLeafNative) {
+				long ret;
+
+				stack -= iparams;
+				ret = imethod->code.nativeFunc(stack);
+				if (ret > 0) {
+					retValue->obj = CreateRuntimeException((unsigned short)ret);
+					*retType = RET_TYPE_EXCEPTION;
+					goto throw_exception;
+				}
+				if (ret < 0) {
+					VmSetFatalErrorNum(ERR_NativeErrorReturn);
+					goto fatal_error;
+				}
+				if (imethod->returnsValue)
+					stack += imethod->returnsWide ? 2 : 1;
+				break;
+			}
+
 			// push return stack frame:
 			//
 			// program counter pointer
@@ -2301,7 +3423,7 @@ step:
 				if (imethod->code.nativeFunc == NULL)
 					goto method_fatal_error;
 				// return stack frame plus native method active frame
-				if (vmStackPtr + 3 + iparams + 1 + 3 >= vmStackSize)
+				if (vmStackPtr + 3 + iparams + NATIVE_MIN_VARS + 1 + 3 >= vmStackSize)
 					goto stack_overflow_fatal_error;
 			} else {
 				if (imethod->code.codeAttr == NULL)
@@ -2344,101 +3466,26 @@ method_fatal_error:
 			}
 			goto fatal_error;
 			}
-		// NOTE: this is the full list of unsupported opcodes. Adding all
-		// these cases here does not cause the VM executable code to be any
-		// larger, it just makes sure that the compiler uses a jump table
-		// with no spaces in it to make sure performance is as good as we
-		// can get (tested under Codewarrior for PalmOS).
-/*
-		case OP_lconst_0:
-		case OP_lconst_1:
-		case OP_dconst_0:
-		case OP_dconst_1:
-		case OP_ldc2_w:
-		case OP_lload:
-		case OP_dload:
-		case OP_lload_0:
-		case OP_lload_1:
-		case OP_lload_2:
-		case OP_lload_3:
-		case OP_dload_0:
-		case OP_dload_1:
-		case OP_dload_2:
-		case OP_dload_3:
-		case OP_laload:
-		case OP_daload:
-		case OP_lstore:
-		case OP_dstore:
-		case OP_lstore_0:
-		case OP_lstore_1:
-		case OP_lstore_2:
-		case OP_lstore_3:
-		case OP_dstore_0:
-		case OP_dstore_1:
-		case OP_dstore_2:
-		case OP_dstore_3:
-		case OP_lastore:
-		case OP_dastore:
-		case OP_ladd:
-		case OP_dadd:
-		case OP_lsub:
-		case OP_dsub:
-		case OP_lmul:
-		case OP_dmul:
-		case OP_ldiv:
-		case OP_ddiv:
-		case OP_lrem:
-		case OP_drem:
-		case OP_lneg:
-		case OP_dneg:
-		case OP_lshl:
-		case OP_lshr:
-		case OP_lushr:
-		case OP_land:
-		case OP_lor:
-		case OP_lxor:
-		case OP_i2l:
-		case OP_i2d:
-		case OP_l2i:
-		case OP_l2f:
-		case OP_l2d:
-		case OP_f2l:
-		case OP_f2d:
-		case OP_d2i:
-		case OP_d2l:
-		case OP_d2f:
-		case OP_lcmp:
-		case OP_dcmpl:
-		case OP_dcmpg:
-		case OP_lreturn:
-		case OP_dreturn:
-		case OP_fconst_0:
-		case OP_fconst_1:
-		case OP_fconst_2:
-		case OP_faload:
-		case OP_fastore:
-		case OP_fload:
-		case OP_fload_0:
-		case OP_fload_1:
-		case OP_fload_2:
-		case OP_fload_3:
-		case OP_fstore:
-		case OP_fstore_0:
-		case OP_fstore_1:
-		case OP_fstore_2:
-		case OP_fstore_3:
-		case OP_fadd:
-		case OP_fsub:
-		case OP_fmul:
-		case OP_fdiv:
-		case OP_frem:
-		case OP_fneg:
-		case OP_i2f:
-		case OP_f2i:
-		case OP_fcmpl:
-		case OP_fcmpg:
-		case OP_freturn:
-*/
+		case OP_invokedynamic:
+			{
+			Var v;
+			unsigned char vType;
+
+			// only string concatenation is supported (see concatStrings())
+			i = concatStrings(curwclass, utils_get_uint16b(&pc[1]), stack, &vType, &v);
+			if (i < 0)
+				goto fatal_error;
+			if (vType == RET_TYPE_EXCEPTION) {
+				*retValue = v;
+				*retType = RET_TYPE_EXCEPTION;
+				goto throw_exception;
+			}
+			stack -= i;
+			stack[0] = v;
+			stack++;
+			pc += 5;
+			break;
+			}
 		default:
 			VmSetFatalErrorNum(ERR_BadOpcode);
 			goto fatal_error;
@@ -2448,31 +3495,31 @@ method_fatal_error:
 array_store_error:
 	retValue->obj = CreateRuntimeException(ERR_ArrayStoreException);
 	*retType = RET_TYPE_EXCEPTION;
-	goto step;
+	goto throw_exception;
 negative_array_size_error:
 	retValue->obj = CreateRuntimeException(ERR_NegativeArraySize);
 	*retType = RET_TYPE_EXCEPTION;
-	goto step;
+	goto throw_exception;
 null_obj_error:
 	retValue->obj = CreateRuntimeException(ERR_NullObjectAccess);
 	*retType = RET_TYPE_EXCEPTION;
-	goto step;
+	goto throw_exception;
 div_by_zero_error:
 	retValue->obj = CreateRuntimeException(ERR_DivideByZero);
 	*retType = RET_TYPE_EXCEPTION;
-	goto step;
+	goto throw_exception;
 index_range_error:
 	retValue->obj = CreateRuntimeException(ERR_IndexOutOfRange);
 	*retType = RET_TYPE_EXCEPTION;
-	goto step;
+	goto throw_exception;
 null_array_error:
 	retValue->obj = CreateRuntimeException(ERR_NullArrayAccess);
 	*retType = RET_TYPE_EXCEPTION;
-	goto step;
+	goto throw_exception;
 class_cast_error:
 	retValue->obj = CreateRuntimeException(ERR_ClassCastException);
 	*retType = RET_TYPE_EXCEPTION;
-	goto step;
+	goto throw_exception;
 
 out_of_objectmem_fatal_error:
 	VmSetFatalErrorNum(ERR_OutOfObjectMem);
@@ -2500,17 +3547,26 @@ method_return:
 	if (vmStackPtr > baseFramePtr){
 		stack = (Var *)vmStack[--vmStackPtr].refValue;
 		if (*retType == RET_TYPE_EXCEPTION || *retType == RET_TYPE_RETURN ){
-			stack[0] = *retValue;
+			stack[0] = retValue[0];
 			stack++;
+			if (*retType == RET_TYPE_RETURN && curmethod->returnsWide) {
+				stack[0] = retValue[1];
+				stack++;
+			}
 		}
 		var = (Var *)vmStack[--vmStackPtr].refValue;
 		pc = vmStack[--vmStackPtr].pc;
 		curwclass = (WClass *)vmStack[vmStackPtr - 1].refValue;
 		curmethod = (WClassMethod *)vmStack[vmStackPtr - 2].refValue;
 
+		if (*retType == RET_TYPE_EXCEPTION)
+			goto throw_exception;
 		goto step;
 	}else if (vmStackPtr == baseFramePtr) {
 		// fully completed execution
+		callerRetValue[0] = retValue[0];
+		if (*retType == RET_TYPE_RETURN && curmethod->returnsWide)
+			callerRetValue[1] = retValue[1];
 //		if (*retType == RET_TYPE_EXCEPTION)
 //			return 1;
 		return FT_ERR_OK;
@@ -2520,47 +3576,93 @@ method_return:
 	}
 }
 
-WObject CreateRuntimeException(unsigned short errNum) {
-	UtfString exceptName;
-	Var retVar;
-	unsigned char retType;
-	long ret;
-
+static unsigned long runtimeExceptionIndex(unsigned short errNum) {
 	switch( errNum ){
 		case ERR_NullObjectAccess:
 		case ERR_NullArrayAccess:
-			exceptName = createUtfString( "java/lang/NullPointerException" );
-			break;
+			return EXCEPTION_NullPointer;
 		case ERR_IndexOutOfRange:
-			exceptName = createUtfString( "java/lang/ArrayIndexOutOfBoundsException" );
-			break;
+			return EXCEPTION_IndexOutOfBounds;
 		case ERR_DivideByZero:
-			exceptName = createUtfString( "java/lang/ArithmeticException" );
-			break;
+			return EXCEPTION_Arithmetic;
 		case ERR_CantFindClass:
-			exceptName = createUtfString( "java/lang/ClassNotFoundException" );
-			break;
+			return EXCEPTION_ClassNotFound;
 		case ERR_ClassCastException:
-			exceptName = createUtfString( "java/lang/ClassCastException" );
-			break;
+			return EXCEPTION_ClassCast;
 		case ERR_NegativeArraySize:
-			exceptName = createUtfString( "java/lang/NegativeArraySizeException" );
-			break;
+			return EXCEPTION_NegativeArraySize;
 		case ERR_ArrayStoreException:
-			exceptName = createUtfString( "java/lang/ArrayStoreException" );
-			break;
-		default:
-			exceptName = createUtfString( "java/lang/RuntimeException" );
-			break;
+			return EXCEPTION_ArrayStore;
 	}
-	ret = newClass( exceptName, createUtfString( "java/lang/Exception" ), &retType, &retVar );
+	return EXCEPTION_Runtime;
+}
+
+// create a runtime exception (without its class and constructor lookup)
+static WObject newRuntimeException(RuntimeExceptionClass *e) {
+	WObject obj;
+	Var params[1], retVar[2];
+	unsigned char retType;
+	long ret;
+
+	obj = createObject(e->wclass);
+	if (obj == WOBJECT_NULL)
+		return WOBJECT_NULL;
+	if (e->initMethod == NULL)
+		return obj;
+	if (pushObject(obj) != FT_ERR_OK)  // make sure it doesn't get GC'd
+		return WOBJECT_NULL;
+	params[0].obj = obj;
+	ret = executeMethod(e->wclass, e->initMethod, params, 1, &retType, retVar);
+	popObject();
 	if (ret != 0 || retType != RET_TYPE_NONE)
-	{
-		VmSetFatalErrorNum(ERR_Unknown);
 		return WOBJECT_NULL;
+	return obj;
+}
+
+// Look up the classes and constructors of the runtime exceptions. An
+// exception class missing from the class library is thrown as a
+// RuntimeException, which must be there.
+static int initRuntimeExceptions(void) {
+	RuntimeExceptionClass *e;
+	char *className;
+	unsigned long i;
+
+	for (i = 0; i < NUM_RUNTIME_EXCEPTIONS; i++) {
+		e = &runtimeExceptions[i];
+		e->wclass = getClass(createUtfString(e->className));
+		if (e->wclass == NULL) {
+			if (i == EXCEPTION_Runtime)
+				return FT_ERR_NOTFOUND;
+			VmResetError();
+			className = e->className;
+			*e = runtimeExceptions[EXCEPTION_Runtime];
+			e->className = className;
+			continue;
+		}
+		e->initMethod = getMethod(e->wclass, createUtfString("<init>"), createUtfString("()V"), NULL);
+		e->instance = WOBJECT_NULL;
+#ifdef PREALLOCATED_EXCEPTIONS
+		e->instance = newRuntimeException(e);
+		if (e->instance == WOBJECT_NULL || addStaticRoot(&e->instance) != FT_ERR_OK)
+			return FT_ERR_NOTENOUGH;
+#endif
 	}
+	return FT_ERR_OK;
+}
 
-	return retVar.obj;
+WObject CreateRuntimeException(unsigned short errNum) {
+	RuntimeExceptionClass *e;
+	WObject obj;
+
+	e = &runtimeExceptions[runtimeExceptionIndex(errNum)];
+#ifdef PREALLOCATED_EXCEPTIONS
+	obj = e->instance;
+#else
+	obj = newRuntimeException(e);
+#endif
+	if (obj == WOBJECT_NULL)
+		VmSetFatalErrorNum(ERR_Unknown);
+	return obj;
 }
 
 void VmResetError(void){
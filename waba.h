@@ -1,6 +1,8 @@
 #ifndef _WABA_H_
 #define _WABA_H_
 
+#include <string.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif // __cplusplus
@@ -11,15 +13,31 @@ extern "C" {
 typedef unsigned short ConsOffsetType;
 #define MAX_consOffset 0x7FFF
 #define CLASS_HASH_SIZE	63
+#define NATIVE_HASH_SIZE	64
+#define MAX_NATIVE_METHODS	256
+#define STREAM_BUFFER_SIZE	4096
 
 #else
 
 typedef unsigned long ConsOffsetType;
 #define MAX_consOffset 0x7FFFFFFF
 #define CLASS_HASH_SIZE	255
+#define NATIVE_HASH_SIZE	256
+#define MAX_NATIVE_METHODS	1024
+#define STREAM_BUFFER_SIZE	65536
 
 #endif
 
+// Strings whose characters all fit in Latin-1 keep one byte per character
+// (see java/lang/String.COMPACT_STRINGS which must match)
+#define COMPACT_STRINGS 1
+
+// Throw a single preallocated instance of each runtime exception the VM
+// raises itself (null access, index out of range, division by zero...)
+// instead of creating a new one every time. The instances are shared,
+// so anything stored in one is seen by the next throw.
+//#define PREALLOCATED_EXCEPTIONS 1
+
 //
 // types and accessors
 //
@@ -27,45 +45,119 @@ typedef unsigned long WObject;
 
 #define WOBJECT_NULL 0
 
+typedef float float32;
+typedef double float64;
+
 typedef union {
 	long intValue;
-	unsigned char uint8Value;
-//	float32 floatValue;
+	unsigned long header;
+	float32 floatValue;
 	void *classRef;
 	unsigned char *pc;
 	void *refValue;
 	WObject obj;
 } Var;
 
+// long values
+typedef long long int64;
+typedef unsigned long long uint64;
+
+// A long takes two Vars on the stack, in local variables and in static
+// variables (the first Var is the one at the lower address). Since Vars
+// are only 4 byte aligned the value is copied in and out. These are
+// also used for long variables in objects and arrays.
+static inline int64 getInt64(const void *p) {
+	int64 value;
+
+	memcpy(&value, p, sizeof(int64));
+	return value;
+}
+
+static inline void setInt64(void *p, int64 value) {
+	memcpy(p, &value, sizeof(int64));
+}
+
+// A double takes two Vars like a long, a float fits in one (floatValue)
+static inline float64 getFloat64(const void *p) {
+	float64 value;
+
+	memcpy(&value, p, sizeof(float64));
+	return value;
+}
+
+static inline void setFloat64(void *p, float64 value) {
+	memcpy(p, &value, sizeof(float64));
+}
+
+// the IEEE 754 value with the given bits (as stored in class files)
+static inline float32 float32FromBits(unsigned long bits) {
+	unsigned int b;
+	float32 value;
+
+	b = (unsigned int)bits;
+	memcpy(&value, &b, sizeof(float32));
+	return value;
+}
+
+static inline float64 float64FromBits(uint64 bits) {
+	float64 value;
+
+	memcpy(&value, &bits, sizeof(float64));
+	return value;
+}
+
 //
 // more types and accessors
 //
 
 Var *objectPtr(WObject obj);
 
-#define WOBJ_class(o) (objectPtr(o))[0].classRef
+// The first word of an object is a pointer to its class. Arrays have
+// no class, in its place is a header word with the length, the element
+// type and the lowest bit set (class pointers never have it set).
+#define ARRAY_HEADER(type, len) (((unsigned long)(len) << 5) | ((unsigned long)(type) << 1) | 1)
+#define ARRAY_MAX_LEN 0x7FFFFFFL // what fits in the header word
+
+#define WOBJ_isArray(o) WOBJ_isArrayP(objectPtr(o))
+#define WOBJ_class(o) WOBJ_classP(objectPtr(o))
+#define WOBJ_setClass(o, wclass) ((objectPtr(o))[0].classRef = (wclass))
 #define WOBJ_var(o, idx) (objectPtr(o))[idx + 1]
+#define WOBJ_field(o, off) WOBJ_fieldP(objectPtr(o), off)
 // for faster access
+#define WOBJ_isArrayP(objPtr) (((objPtr)[0].header & 1) != 0)
+#define WOBJ_classP(objPtr) (WOBJ_isArrayP(objPtr) ? NULL : (objPtr)[0].classRef)
 #define WOBJ_varP(objPtr, idx) (objPtr)[idx + 1]
+// the object variables are packed (see layoutClassFields()), off is the
+// byte offset of a variable after the class pointer
+#define WOBJ_fieldP(objPtr, off) ((unsigned char *)&(objPtr)[1] + (off))
 
 // NOTE: These get various values in objects at defined offsets.
 // If the variables in the base classes change, these offsets will
-// need to be recomputed. For example, the first (StringCharArray)
-// get the character array var offset in a String object.
-#define WOBJ_StringCharArrayObj(o) WOBJ_var(o,0).obj
-
-#define WOBJ_StringBufferStrings(o) WOBJ_var(o,0).obj
-#define WOBJ_StringBufferCount(o) WOBJ_var(o,1).intValue
-
-//#define WOBJ_arrayType(o) ((unsigned char)(WOBJ_var(o,0).intValue))
-#define WOBJ_arrayType(o) WOBJ_var(o,0).uint8Value
-#define WOBJ_arrayLen(o) WOBJ_var(o,1).intValue
-#define WOBJ_arrayStart(o) (&(WOBJ_var(o,2)))
+// need to be recomputed. For example, the first (StringValue)
+// get the byte array var offset in a String object.
+#define WOBJ_StringValueObj(o) (*(WObject *)WOBJ_field(o,0))
+#define WOBJ_StringCoder(o) (*(unsigned char *)WOBJ_field(o,sizeof(WObject)))
+
+// String coders, the value of a STRING_UTF16 string holds two bytes per
+// character with the low byte first
+#define STRING_LATIN1 0
+#define STRING_UTF16  1
+
+// StringBuilder and StringBuffer
+#define WOBJ_StringBuilderValue(o) (*(WObject *)WOBJ_field(o,0))
+#define WOBJ_StringBuilderCount(o) (*(long *)WOBJ_field(o,sizeof(WObject)))
+#define WOBJ_StringBuilderCoder(o) (*(unsigned char *)WOBJ_field(o,sizeof(WObject)+sizeof(long)))
+
+#define WOBJ_arrayType(o) WOBJ_arrayTypeP(objectPtr(o))
+#define WOBJ_arrayLen(o) WOBJ_arrayLenP(objectPtr(o))
+#define WOBJ_arrayStart(o) WOBJ_arrayStartP(objectPtr(o))
+#define WOBJ_setArrayHeader(o, type, len) WOBJ_setArrayHeaderP(objectPtr(o), type, len)
 
 // for faster access
-#define WOBJ_arrayTypeP(objPtr) WOBJ_varP(objPtr,0).intValue
-#define WOBJ_arrayLenP(objPtr) WOBJ_varP(objPtr,1).intValue
-#define WOBJ_arrayStartP(objPtr) (&(WOBJ_varP(objPtr,2)))
+#define WOBJ_arrayTypeP(objPtr) ((unsigned char)(((objPtr)[0].header >> 1) & 0xF))
+#define WOBJ_arrayLenP(objPtr) ((long)((objPtr)[0].header >> 5))
+#define WOBJ_arrayStartP(objPtr) (&(objPtr)[1])
+#define WOBJ_setArrayHeaderP(objPtr, type, len) ((objPtr)[0].header = ARRAY_HEADER(type, len))
 
 typedef struct {
 	Var *ptr;
@@ -82,19 +174,22 @@ typedef union {
 	// FieldVar is either a reference to a static class variable (staticVar)
 	// or an offset of a local variable within an object (varOffset)
 	Var staticVar;
-	unsigned long varOffset; // computed var offset in object
+	Var staticVars[2]; // long and double static variables take two Vars
+	unsigned long varOffset; // computed byte offset in object
 } FieldVar;
 
 typedef struct WClassFieldStruct {
 	unsigned char *header;
 	FieldVar var;
+	unsigned char type; // TYPE_XXX of the field
 } WClassField;
 
 typedef struct WClassHandlerStruct {
 	unsigned short start_pc;
 	unsigned short end_pc;
 	unsigned short handler_pc;
-	unsigned short catch_type;
+	unsigned short catch_type; // 0 catches everything (finally)
+	struct WClassStruct *catchClass; // catch_type once resolved, see findHandler()
 } WClassHandler;
 
 //
@@ -133,8 +228,10 @@ typedef union {
 typedef struct WClassMethodStruct {
 	unsigned char *header;
 	Code code;
-	unsigned short numParams:14;
+	unsigned short numParams:12;
+	unsigned short isLeafNative:1; // native with NATIVE_LEAF
 	unsigned short returnsValue:1;
+	unsigned short returnsWide:1; // returns a long or double (two Vars)
 	unsigned short isInit:1;
 	unsigned short numHandlers;
 	WClassHandler *handlers;
@@ -163,11 +260,18 @@ typedef struct WClassStruct {
 	unsigned char *attrib2; // pointer to area after constant pool (accessFlags)
 	unsigned short numConstants;
 	ConsOffsetType *constantOffsets;
+	unsigned short numStrings;
+	unsigned short *stringIndexes; // String constants in the constant pool (sorted)
+	WObject *strings; // interned String objects of the String constants
 	unsigned short numFields;
 	WClassField *fields;
 	unsigned short numMethods;
 	WClassMethod *methods;
-	unsigned short numVars; // computed number of object variables
+	unsigned short varsSize; // computed size of the object variables in bytes
+	unsigned short numRefs;
+	unsigned short *refOffsets; // offsets of the object references (for the GC)
+	unsigned short numBootstrapMethods;
+	unsigned char **bootstrapMethods; // entries of the BootstrapMethods attribute
 	ObjDestroyFunc objDestroyFunc;
 	struct WClassStruct *nextClass; // next class in hash table linked list
 } WClass;
@@ -177,7 +281,7 @@ typedef struct WClassStruct {
 #define WCLASS_superClass(wc) utils_get_uint16b(&wc->attrib2[4])
 #define WCLASS_numInterfaces(wc) utils_get_uint16b(&wc->attrib2[6])
 #define WCLASS_interfaceIndex(wc, idx) utils_get_uint16b(&wc->attrib2[8 + (idx * 2)])
-#define WCLASS_objectSize(wc) ((wc->numVars + 1) * sizeof(Var))
+#define WCLASS_objectSize(wc) (sizeof(Var) + wc->varsSize)
 #define WCLASS_isInterface(wc) ((WCLASS_accessFlags(wc) & ACC_INTERFACE) != 0)
 #define WCLASS_isAbstract(wc) ((WCLASS_accessFlags(wc) & ACC_ABSTRACT) != 0)
 
@@ -194,6 +298,10 @@ typedef struct WClassStruct {
 #define CONSTANT_Methodref          10
 #define CONSTANT_InterfaceMethodref 11
 #define CONSTANT_NameAndType        12
+#define CONSTANT_MethodHandle       15
+#define CONSTANT_MethodType         16
+#define CONSTANT_Dynamic            17
+#define CONSTANT_InvokeDynamic      18
 
 #define CONS_offset(wc, idx) wc->constantOffsets[idx]
 #define CONS_ptr(wc, idx) (wc->byteRep + CONS_offset(wc, idx))
@@ -201,12 +309,23 @@ typedef struct WClassStruct {
 #define CONS_utfLen(wc, idx) utils_get_uint16b(&CONS_ptr(wc, idx)[1])
 #define CONS_utfStr(wc, idx) (&CONS_ptr(wc, idx)[3])
 #define CONS_integer(wc, idx) utils_get_int32b(&CONS_ptr(wc, idx)[1])
+#define CONS_long(wc, idx) ((int64)(((uint64)utils_get_uint32b(&CONS_ptr(wc, idx)[1]) << 32) | \
+	(uint64)utils_get_uint32b(&CONS_ptr(wc, idx)[5])))
+#define CONS_float(wc, idx) float32FromBits(utils_get_uint32b(&CONS_ptr(wc, idx)[1]))
+#define CONS_double(wc, idx) float64FromBits((uint64)CONS_long(wc, idx))
 #define CONS_stringIndex(wc, idx) utils_get_uint16b(&CONS_ptr(wc, idx)[1])
 #define CONS_classIndex(wc, idx) utils_get_uint16b(&CONS_ptr(wc, idx)[1])
 #define CONS_nameIndex(wc, idx) utils_get_uint16b(&CONS_ptr(wc, idx)[1])
 #define CONS_typeIndex(wc, idx) utils_get_uint16b(&CONS_ptr(wc, idx)[3])
 #define CONS_nameAndTypeIndex(wc, idx) utils_get_uint16b(&CONS_ptr(wc, idx)[3])
 #define CONS_descriptorIndex(wc, idx) utils_get_uint16b(&CONS_ptr(wc, idx)[3])
+#define CONS_bootstrapIndex(wc, idx) utils_get_uint16b(&CONS_ptr(wc, idx)[1])
+#define CONS_methodHandleRef(wc, idx) utils_get_uint16b(&CONS_ptr(wc, idx)[2])
+
+// entries of the BootstrapMethods attribute
+#define BSM_methodRef(bsm) utils_get_uint16b(bsm)
+#define BSM_numArgs(bsm) utils_get_uint16b(&(bsm)[2])
+#define BSM_arg(bsm, i) utils_get_uint16b(&(bsm)[4 + ((i) * 2)])
 
 //
 // Native Methods and Hooks
@@ -217,14 +336,32 @@ typedef struct {
 	unsigned short varsNeeded;
 } ClassHook;
 
+// A native method is found by the name of its class, its name and its
+// descriptor, e.g. { "base/framework/System", "gc", "()V", FCSystem_gc }.
 typedef struct {
-	unsigned long hash;
+	const char *className;
+	const char *name;
+	const char *desc;
 	NativeFunc func;
+	unsigned short flags; // NATIVE_XXX
 } NativeMethod;
 
+// A leaf native is called right on the operand stack of the calling
+// method, without a frame of its own. It must not allocate objects, run
+// Java code or look at the VM stack (it is not in stack traces) but it
+// may return an exception code.
+#define NATIVE_LEAF	0x0001
+
+// Add native methods to the ones of the class library (a method that is
+// already there gets the new function). The strings are not copied so
+// they must stay valid. Methods of classes that are already loaded keep
+// the function they got when their class loaded.
+long VmRegisterNative(const char *className, const char *name, const char *desc, NativeFunc func, unsigned short flags);
+long VmRegisterNatives(const NativeMethod *methods, unsigned long numMethods);
+
 
 long VmInit(unsigned long vmStackSizeInBytes, unsigned long nmStackSizeInBytes,
-	unsigned long classHeapSize, unsigned long objectHeapSize );
+	unsigned long classHeapSize, unsigned long objectHeapSize, unsigned long objectHeapMaxSize );
 void VmFree(void);
 
 WObject createObject(WClass *wclass);
@@ -232,7 +369,15 @@ WObject createArrayObject(unsigned char type, long len);
 int pushObject(WObject obj);
 WObject popObject(void);
 
-void gc(void);
+void gc(unsigned long reason);
+
+// kinds of GC roots, see walkRoots()
+#define ROOT_VM_STACK	0
+#define ROOT_NM_STACK	1
+#define ROOT_STATIC		2
+
+typedef void (*RootVisitor)(WObject obj, unsigned long kind, void *arg);
+void walkRoots(RootVisitor visit, void *arg);
 
 long newClass(UtfString className, UtfString baseClassName, unsigned char *retType, Var* retVar);
 WClass *getClass(UtfString className);
@@ -247,7 +392,9 @@ long executeMethod(WClass *wclass, WClassMethod *method, Var params[], unsigned
 typedef struct _T_MEMINFO
 {
 	unsigned long totalObjectMem;
+	unsigned long maxObjectMem;
 	unsigned long unusedObjectMem;
+	unsigned long largeObjectMem;
 	unsigned long totalClassMem;
 	unsigned long unusedClassMem;
 	unsigned long vmStackSize;
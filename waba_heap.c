@@ -2,6 +2,7 @@
 #include "utils.h"
 #include "mem_alloc.h"
 #include "waba_heap.h"
+#include "waba_heapdump.h"
 #include <string.h>
 
 //
@@ -41,24 +42,95 @@
 // So, when the Hos array is indexed, it is always negative (first
 // element is 0, next is -1, next is -2, etc).
 
+// The sweep does not move objects. The holes that dead objects leave
+// between the live ones are threaded into size segregated free lists
+// that allocObject() takes from before it bumps objectSize. Only when
+// an allocation still fails after a collection are the live objects
+// slid together (see compactObjects()). To make both the hole search
+// and the compaction possible, the used part of the order array is
+// sorted by object address at the end of every sweep.
+//
 // NOTE: The total amount of memory used up at any given
 // time in the heap is: objectSize + (numHandles * sizeof(Hos))
+// minus the bytes held in the free lists
+
+// The heap starts out at its initial size and is resized after a
+// collection depending on how much of it survived. When most of it
+// survives it is doubled (up to the maximum size) so the collector
+// doesn't run over and over again on a heap that is nearly full. When
+// little survives several collections in a row the program has gone
+// idle and the heap is halved again (never below the initial size).
+// Resizing allocates a new block, copies the compacted objects and the
+// Hos array over and frees the old one, so handles stay valid. Both
+// blocks are needed at once, so when the memory has no room for the
+// doubled size the heap grows by as much as does fit.
+#define HEAP_GROW_SURVIVAL		60 // in percent of the heap
+#define HEAP_SHRINK_SURVIVAL	20
+#define HEAP_SHRINK_GCS			4 // collections in a row before shrinking
+#define HEAP_RESIZE_STEP		1024 // smallest step when trying a smaller block
+
+// a hole in the object area. Holes smaller than a FreeChunk can't be
+// linked in and are only reclaimed by the next sweep or compaction
+typedef struct FreeChunkStruct {
+	unsigned long size;
+	struct FreeChunkStruct *next;
+} FreeChunk;
+
+// Objects of LARGE_OBJECT_SIZE bytes or more (in practice big arrays)
+// are not put in the heap at all. They are allocated on their own with
+// mem_alloc() so they are never moved or copied and don't fragment the
+// space the Hos array grows into. They still get a handle so they are
+// marked like any other object, the sweep frees them with mem_free().
+#define LARGE_OBJECT_SIZE	1024
+
+#define IS_LARGE_PTR(p) ((unsigned char *)(p) < heap.mem || \
+	(unsigned char *)(p) >= &heap.mem[heap.memSize])
+
+// holes below NUM_EXACT_LISTS * 4 bytes are kept in lists of exactly
+// one size (sizes are multiples of 4), larger ones share the last list
+#define NUM_EXACT_LISTS	16
+#define NUM_FREE_LISTS	(NUM_EXACT_LISTS + 1)
+
 typedef struct {
 	Hos *hos; // handle, order and scan arrays (interlaced)
 	unsigned long numHandles;
 	unsigned long numFreeHandles;
 	unsigned char *mem;
 	unsigned long memSize; // total size of memory (including free)
-	unsigned long objectSize; // size of all objects in heap
+	unsigned long objectSize; // size of the object area (including holes)
+	FreeChunk *freeLists[NUM_FREE_LISTS];
+	unsigned long freeListSize; // size of all holes in the free lists
+	unsigned long largeObjectSize; // size of all objects outside the heap
+	unsigned long initSize; // the heap never shrinks below this
+	unsigned long maxSize; // or grows beyond this
+	unsigned long numIdleGcs; // low survival collections in a row
 } ObjectHeap;
 
 static ObjectHeap heap = { 0 };
 
+AllocBuffer allocBuffer = { 0 };
+
+// objects up to this size are allocated from allocation buffers
+#define ALLOC_BUFFER_OBJECT_SIZE	(ALLOC_BUFFER_SIZE / 4)
+
+// GC statistics. The last GC_HISTORY_SIZE collections are kept in a
+// ring buffer, gcRecord is the one of the collection running (or the
+// last one) which compaction and resizing add to.
+static GcTotals gcTotals = { 0 };
+static GcRecord gcHistory[GC_HISTORY_SIZE];
+static GcRecord *gcRecord = NULL;
+static unsigned long gcStartTime;
+
+// the objects allocated from an allocation buffer are only counted
+// when it is retired, these are its top and reserved handles back then
+static unsigned char *allocBufferStart = NULL;
+static unsigned long allocBufferHandles = 0;
+
 // NOTE: this method is only for printing the status of memory
 // and can be removed. Also note, there is no such thing as
 // the "amount of free memory" because of garbage collection.
 unsigned long getUnusedMemSize(void) {
-	return heap.memSize - (heap.objectSize + (heap.numHandles * sizeof(Hos)));
+	return heap.memSize - (heap.objectSize + (heap.numHandles * sizeof(Hos))) + heap.freeListSize;
 }
 
 unsigned long getTotalMemSize(void)
@@ -66,22 +138,114 @@ unsigned long getTotalMemSize(void)
 	return heap.memSize;
 }
 
+unsigned long getMaxMemSize(void)
+{
+	return heap.maxSize;
+}
+
+unsigned long getLargeObjectSize(void)
+{
+	return heap.largeObjectSize;
+}
+
 unsigned long getNumHandles(void)
 {
 	return heap.numHandles;
 }
 
-int initObjectHeap(unsigned long heapSize) {
+static void clearFreeLists(void) {
+	unsigned long i;
+
+	for (i = 0; i < NUM_FREE_LISTS; i++)
+		heap.freeLists[i] = NULL;
+	heap.freeListSize = 0;
+}
+
+// count what has been allocated from the allocation buffer
+static void retireAllocBuffer(void) {
+	if (allocBufferStart != NULL)
+		gcTotals.bytesAllocated += allocBuffer.top - allocBufferStart;
+	gcTotals.objectsAllocated += allocBufferHandles - allocBuffer.numHandles;
+	allocBufferStart = NULL;
+	allocBufferHandles = allocBuffer.numHandles;
+}
+
+static void dropAllocBuffer(void) {
+	retireAllocBuffer();
+	allocBuffer.top = NULL;
+	allocBuffer.end = NULL;
+	allocBuffer.hos = heap.hos;
+	allocBuffer.numHandles = 0;
+	allocBufferStart = NULL;
+	allocBufferHandles = 0;
+}
+
+void beginGcRecord(unsigned long reason) {
+	gcRecord = &gcHistory[gcTotals.numGcs % GC_HISTORY_SIZE];
+	memset(gcRecord, 0x00, sizeof(GcRecord));
+	gcRecord->reason = reason;
+	gcTotals.numGcs++;
+	gcStartTime = utils_get_usec();
+}
+
+// account for time spent in a part of the collection that started at
+// startTime and return the time now
+static unsigned long endGcPhase(unsigned long *phaseTime, unsigned long startTime) {
+	unsigned long now, pause;
+
+	now = utils_get_usec();
+	*phaseTime += now - startTime;
+	gcTotals.pauseTime += now - startTime;
+	pause = gcRecord->markTime + gcRecord->sweepTime + gcRecord->compactTime;
+	if (pause > gcTotals.maxPauseTime)
+		gcTotals.maxPauseTime = pause;
+	return now;
+}
+
+void getGcTotals(GcTotals *totals) {
+	*totals = gcTotals;
+	// add what the current allocation buffer has handed out so far
+	if (allocBufferStart != NULL)
+		totals->bytesAllocated += allocBuffer.top - allocBufferStart;
+	totals->objectsAllocated += allocBufferHandles - allocBuffer.numHandles;
+}
+
+// copy the most recent collections (the last one first) and return
+// how many were copied
+unsigned long getGcHistory(GcRecord *records, unsigned long maxRecords) {
+	unsigned long i, n;
+
+	n = gcTotals.numGcs;
+	if (n > GC_HISTORY_SIZE)
+		n = GC_HISTORY_SIZE;
+	if (n > maxRecords)
+		n = maxRecords;
+	for (i = 0; i < n; i++)
+		records[i] = gcHistory[(gcTotals.numGcs - 1 - i) % GC_HISTORY_SIZE];
+	return n;
+}
+
+// NOTE: maxHeapSize less than heapSize means the heap is not resized
+int initObjectHeap(unsigned long heapSize, unsigned long maxHeapSize) {
 
 	if (heap.mem != NULL)
 		return FT_ERR_INVALID_STATUS;
 
 	heap.numHandles = 0;
 	heap.numFreeHandles = 0;
+	heap.largeObjectSize = 0;
+	heap.numIdleGcs = 0;
+	clearFreeLists();
 	heap.memSize = heapSize;
 
 	// align to 4 byte boundry for correct alignment of the Hos array
 	heap.memSize = (heap.memSize + 3) & ~3;
+	heap.initSize = heap.memSize;
+	heap.maxSize = (maxHeapSize + 3) & ~3;
+	memset(&gcTotals, 0x00, sizeof(GcTotals));
+	gcRecord = NULL;
+	if (heap.maxSize < heap.initSize)
+		heap.maxSize = heap.initSize;
 
 	// allocate and zero out memory region
 	heap.mem = (unsigned char *)mem_alloc(heap.memSize);
@@ -90,6 +254,7 @@ int initObjectHeap(unsigned long heapSize) {
 	memset(heap.mem, 0x00, heap.memSize);
 	heap.hos = (Hos *)(&heap.mem[heap.memSize - sizeof(Hos)]);
 	heap.objectSize = 0;
+	dropAllocBuffer();
 
 	return FT_ERR_OK;
 }
@@ -109,34 +274,306 @@ void freeObjectHeap(void) {
 			wclass = WOBJ_class(obj);
 			if (wclass != NULL && wclass->objDestroyFunc)
 				wclass->objDestroyFunc(obj);
+			if (IS_LARGE_PTR(objectPtr(obj)))
+				mem_free(objectPtr(obj));
 		}
 	}
 
 	heap.numHandles = 0;
+	heap.largeObjectSize = 0;
 	heap.numFreeHandles = 0;
 	heap.memSize = 0;
+	heap.initSize = 0;
+	heap.maxSize = 0;
+	dropAllocBuffer();
 
 	mem_free(heap.mem);
 	heap.mem = NULL;
 }
 
+static unsigned long freeListIndex(unsigned long size) {
+	if ((size >> 2) < NUM_EXACT_LISTS)
+		return size >> 2;
+	return NUM_EXACT_LISTS;
+}
+
+static void addFreeChunk(unsigned char *p, unsigned long size) {
+	FreeChunk *chunk;
+	unsigned long idx;
+
+	if (size < sizeof(FreeChunk))
+		return; // too small to link in, wait for the next sweep
+	chunk = (FreeChunk *)p;
+	idx = freeListIndex(size);
+	chunk->size = size;
+	chunk->next = heap.freeLists[idx];
+	heap.freeLists[idx] = chunk;
+	heap.freeListSize += size;
+}
+
+// take a hole of at least size bytes out of the free lists. The rest
+// of a larger hole is put back in the list for its new size.
+static unsigned char *allocFreeChunk(unsigned long size) {
+	FreeChunk *chunk, **link;
+	unsigned long idx, rest;
+
+	chunk = NULL;
+	for (idx = freeListIndex(size); idx < NUM_EXACT_LISTS; idx++) {
+		if (heap.freeLists[idx] != NULL) {
+			chunk = heap.freeLists[idx];
+			heap.freeLists[idx] = chunk->next;
+			break;
+		}
+	}
+	if (chunk == NULL) {
+		// first fit in the list of large holes
+		link = &heap.freeLists[NUM_EXACT_LISTS];
+		while (*link != NULL && (*link)->size < size)
+			link = &(*link)->next;
+		if (*link == NULL)
+			return NULL;
+		chunk = *link;
+		*link = chunk->next;
+	}
+	rest = chunk->size - size;
+	heap.freeListSize -= chunk->size;
+	addFreeChunk((unsigned char *)chunk + size, rest);
+	// the holes are not kept zeroed like the top of the heap
+	memset(chunk, 0x00, size);
+	return (unsigned char *)chunk;
+}
+
+// size of the Hos array once the next handle has been taken
+static unsigned long nextHosSize(void) {
+	if (heap.numFreeHandles == 0)
+		return (heap.numHandles + 1) * sizeof(Hos);
+	return heap.numHandles * sizeof(Hos);
+}
+
+// NOTE: size passed must be 4 byte aligned (see arraySize())
+static Var *allocMem(unsigned long size) {
+	unsigned long hosSize;
+	unsigned char *p;
+
+	hosSize = nextHosSize();
+	if (hosSize + heap.objectSize > heap.memSize)
+		return NULL; // no room to grow the handle array
+	if (heap.freeListSize >= size) {
+		p = allocFreeChunk(size);
+		if (p != NULL)
+			return (Var *)p;
+	}
+	if (size + hosSize + heap.objectSize > heap.memSize)
+		return NULL;
+	p = &heap.mem[heap.objectSize];
+	heap.objectSize += size;
+	return (Var *)p;
+}
+
+static Var *allocLargeMem(unsigned long size) {
+	unsigned char *p;
+
+	if (nextHosSize() + heap.objectSize > heap.memSize)
+		return NULL; // no room to grow the handle array
+	p = (unsigned char *)mem_alloc(size);
+	if (p == NULL)
+		return NULL;
+	memset(p, 0x00, size);
+	heap.largeObjectSize += size;
+	return (Var *)p;
+}
+
+// give what is left of the allocation buffer back to the heap and
+// carve a new one out of the top of the heap. Returns 0 if there is no
+// room left for a buffer.
+static int refillAllocBuffer(void) {
+	unsigned long h;
+
+	retireAllocBuffer();
+	if (allocBuffer.end == &heap.mem[heap.objectSize])
+		heap.objectSize = allocBuffer.top - heap.mem; // still at the top
+	else if (allocBuffer.top != allocBuffer.end)
+		addFreeChunk(allocBuffer.top, allocBuffer.end - allocBuffer.top);
+	allocBuffer.top = NULL;
+	allocBuffer.end = NULL;
+
+	// reserved handles are kept until they are used or the next sweep
+	while (allocBuffer.numHandles < ALLOC_BUFFER_HANDLES) {
+		if (heap.numFreeHandles) {
+			h = heap.hos[-(long)(heap.numHandles - heap.numFreeHandles)].order;
+			heap.numFreeHandles--;
+		}
+		else {
+			if ((heap.numHandles + 1) * sizeof(Hos) + heap.objectSize > heap.memSize)
+				break;
+			h = heap.numHandles;
+			heap.hos[-(long)h].order = h;
+			heap.numHandles++;
+		}
+		allocBuffer.handles[allocBuffer.numHandles++] = h;
+	}
+	allocBufferHandles = allocBuffer.numHandles;
+	if (allocBuffer.numHandles == 0)
+		return 0;
+	if (heap.objectSize + ALLOC_BUFFER_SIZE + heap.numHandles * sizeof(Hos) > heap.memSize)
+		return 0;
+	allocBuffer.top = &heap.mem[heap.objectSize];
+	allocBuffer.end = allocBuffer.top + ALLOC_BUFFER_SIZE;
+	allocBuffer.hos = heap.hos;
+	heap.objectSize += ALLOC_BUFFER_SIZE;
+	allocBufferStart = allocBuffer.top;
+	return 1;
+}
+
+// size of the live objects in the heap and the Hos array
+static unsigned long liveMemSize(void) {
+	return heap.objectSize - heap.freeListSize + heap.numHandles * sizeof(Hos);
+}
+
+// move the heap into a new block of newSize bytes, or of at least
+// minSize bytes if a block of newSize can't be allocated. The objects
+// are compacted first so this must directly follow a sweepObjects()
+// (see compactObjects()). Returns 0 if the heap was left where it was.
+static int resizeHeap(unsigned long newSize, unsigned long minSize) {
+	unsigned char *mem, *p;
+	Hos *hos;
+	unsigned long h, hosSize, step, startTime;
+
+	newSize = (newSize + 3) & ~3;
+	minSize = (minSize + 3) & ~3;
+	compactObjects();
+	hosSize = heap.numHandles * sizeof(Hos);
+	if (minSize < heap.objectSize + hosSize)
+		minSize = heap.objectSize + hosSize;
+	if (newSize == heap.memSize || minSize > newSize)
+		return 0;
+	while ((mem = (unsigned char *)mem_alloc(newSize)) == NULL) {
+		// halve the distance to minSize and try again
+		if (newSize <= minSize)
+			return 0;
+		step = ((newSize - minSize) / 2) & ~3;
+		newSize = step < HEAP_RESIZE_STEP ? minSize : newSize - step;
+		if (newSize == heap.memSize)
+			return 0;
+	}
+	startTime = utils_get_usec();
+	memcpy(mem, heap.mem, heap.objectSize);
+	memset(&mem[heap.objectSize], 0x00, newSize - heap.objectSize - hosSize);
+	memcpy(&mem[newSize - hosSize], &heap.mem[heap.memSize - hosSize], hosSize);
+	hos = (Hos *)(&mem[newSize - sizeof(Hos)]);
+
+	// point the handles at the new block (large objects don't move)
+	for (h = 0; h < heap.numHandles; h++) {
+		p = (unsigned char *)hos[-(long)h].ptr;
+		if (p != NULL && !IS_LARGE_PTR(p))
+			hos[-(long)h].ptr = (Var *)&mem[p - heap.mem];
+	}
+	mem_free(heap.mem);
+	heap.mem = mem;
+	heap.memSize = newSize;
+	heap.hos = hos;
+	dropAllocBuffer();
+
+	gcTotals.numResizes++;
+	gcTotals.bytesMoved += heap.objectSize + hosSize;
+	gcRecord->bytesMoved += heap.objectSize + hosSize;
+	gcRecord->heapSize = heap.memSize;
+	endGcPhase(&gcRecord->compactTime, startTime);
+	return 1;
+}
+
+// grow or shrink the heap depending on how much of it survived the
+// collection that just ran
+static void adjustHeapSize(void) {
+	unsigned long live, survival, newSize, minSize;
+
+	live = liveMemSize();
+	survival = live * 100 / heap.memSize;
+	if (survival > HEAP_GROW_SURVIVAL) {
+		heap.numIdleGcs = 0;
+		if (heap.memSize >= heap.maxSize)
+			return;
+		newSize = heap.memSize * 2;
+		if (newSize > heap.maxSize)
+			newSize = heap.maxSize;
+		// at least enough to bring the survival down to HEAP_GROW_SURVIVAL
+		minSize = live * 100 / HEAP_GROW_SURVIVAL;
+		if (minSize > newSize)
+			minSize = newSize;
+		resizeHeap(newSize, minSize);
+	}
+	else if (survival < HEAP_SHRINK_SURVIVAL) {
+		if (++heap.numIdleGcs < HEAP_SHRINK_GCS || heap.memSize <= heap.initSize)
+			return;
+		heap.numIdleGcs = 0;
+		newSize = heap.memSize / 2;
+		if (newSize < heap.initSize)
+			newSize = heap.initSize;
+		resizeHeap(newSize, newSize);
+	}
+	else
+		heap.numIdleGcs = 0;
+}
+
+// run the garbage collector and resize the heap if needed
+static void collect(unsigned long reason) {
+	gc(reason);
+	adjustHeapSize();
+}
+
+// grow the heap so that an object of size bytes fits. This must
+// directly follow a sweepObjects() (see resizeHeap()).
+static int growHeap(unsigned long size) {
+	unsigned long needed, newSize;
+
+	needed = liveMemSize() + size + sizeof(Hos);
+	if (needed > heap.maxSize)
+		return 0;
+	newSize = heap.memSize * 2;
+	if (newSize < needed)
+		newSize = needed;
+	if (newSize > heap.maxSize)
+		newSize = heap.maxSize;
+	if (needed <= heap.memSize)
+		needed = heap.memSize + sizeof(Hos);
+	return resizeHeap(newSize, needed);
+}
+
+// This is the slow path of the allocation, see allocObjectFast()
 // NOTE: size passed must be 4 byte aligned (see arraySize())
 WObject allocObject(long size) {
-	unsigned long i, sizeReq, hosSize;
+	unsigned long i;
+	Var *ptr;
 
 	if (size <= 0) {
 		VmSetFatalErrorNum(ERR_ParamError);
 		return WOBJECT_NULL;
 	}
-	sizeReq = size;
-	if (heap.numFreeHandles == 0)
-		sizeReq += sizeof(Hos);
-	hosSize = heap.numHandles * sizeof(Hos);
-
-	if (sizeReq + hosSize + heap.objectSize > heap.memSize) {
-		gc();
-		// heap.objectSize changed or we are out of memory
-		if (sizeReq + hosSize + heap.objectSize > heap.memSize) {
+	if (size <= ALLOC_BUFFER_OBJECT_SIZE && refillAllocBuffer())
+		return allocObjectFast(size);
+	ptr = NULL;
+	if (size >= LARGE_OBJECT_SIZE) {
+		ptr = allocLargeMem(size);
+		if (ptr == NULL) {
+			collect(GC_REASON_LARGE);
+			ptr = allocLargeMem(size);
+		}
+		// if there is no memory left outside the heap, try the heap
+	}
+	if (ptr == NULL)
+		ptr = allocMem(size);
+	if (ptr == NULL) {
+		collect(GC_REASON_ALLOC);
+		ptr = allocMem(size);
+		if (ptr == NULL) {
+			// the free space is too fragmented (or there is none)
+			compactObjects();
+			ptr = allocMem(size);
+		}
+		if (ptr == NULL && growHeap(size))
+			ptr = allocMem(size);
+		if (ptr == NULL) {
+			printHeapStatus();
 			VmSetFatalErrorNum(ERR_OutOfObjectMem);
 			return WOBJECT_NULL;
 		}
@@ -152,8 +589,9 @@ WObject allocObject(long size) {
 		heap.numHandles++;
 	}
 
-	heap.hos[-(long)i].ptr = (Var *)&heap.mem[heap.objectSize];
-	heap.objectSize += size;
+	heap.hos[-(long)i].ptr = ptr;
+	gcTotals.bytesAllocated += size;
+	gcTotals.objectsAllocated++;
 
 	return FIRST_OBJ + i + 1;
 }
@@ -172,59 +610,133 @@ Var *objectPtr(WObject obj) {
 #define MARK(o) (heap.hos[- (long)(o - FIRST_OBJ - 1)].order |= 0x80000000L)
 #define IS_MARKED(o) (heap.hos[- (long)(o - FIRST_OBJ - 1)].order & 0x80000000L)
 
-// mark this object and all the objects this object refers to and all
-// objects those objects refer to, etc.
+// NOTE: this is VALID_OBJ() plus the objectPtr() NULL check without the
+// function calls. It is used in the inner loop of the mark phase which
+// touches every reference in every live object.
+#define IS_LIVE_OBJ(o) ((o) > FIRST_OBJ && (o) <= FIRST_OBJ + heap.numHandles && \
+	heap.hos[- (long)((o) - FIRST_OBJ - 1)].ptr != NULL)
+
+// The mark stack lives in the temp column of the Hos array. Each object
+// is pushed at most once (it is marked when pushed) so the stack can
+// never grow beyond numHandles entries.
+static unsigned long numScan = 0;
+
+#define PUSH_MARK(o) { MARK(o); heap.hos[-(long)numScan].temp = (o); numScan++; }
+
+// mark this object and queue it so that the objects it refers to are
+// marked by traceObjects(). All roots are queued first and the mark
+// stack is drained once instead of once per root.
 void markObject(WObject obj) {
+	if (!IS_LIVE_OBJ(obj) || IS_MARKED(obj))
+		return;
+	PUSH_MARK(obj);
+}
+
+// mark all the objects the queued objects refer to and all objects
+// those objects refer to, etc.
+void traceObjects(void) {
 	WClass *wclass;
-	WObject *arrayStart, o;
-	unsigned long i, len, numScan;
+	WObject *refs, obj, o;
+	Var *objPtr;
+	unsigned long i, len;
 	unsigned char type;
+	unsigned short *refOffsets;
 
-	if (obj == WOBJECT_NULL)
-		return;
-	if (!VALID_OBJ(obj) || objectPtr(obj) == NULL || IS_MARKED(obj))
-		return;
-	MARK(obj);
-	numScan = 0;
-
-markinterior:
-	wclass = WOBJ_class(obj);
-	if (wclass == NULL) {
-		// array - see if it contains object references
-		type = WOBJ_arrayType(obj);
-		if (type == TYPE_OBJECT || type == TYPE_ARRAY) {
+	// NOTE: we use a loop over an explicit stack since we want to avoid
+	// recursion here since structures like linked links could create
+	// deep stack calls
+	while (numScan > 0) {
+		--numScan;
+		obj = heap.hos[-(long)numScan].temp;
+		objPtr = heap.hos[-(long)(obj - FIRST_OBJ - 1)].ptr;
+		if (WOBJ_isArrayP(objPtr)) {
+			// array - see if it contains object references
+			type = WOBJ_arrayTypeP(objPtr);
+			if (type != TYPE_OBJECT && type != TYPE_ARRAY)
+				continue;
 			// for an array of arrays or object array
-			arrayStart = (WObject *)WOBJ_arrayStart(obj);
-			len = WOBJ_arrayLen(obj);
+			refs = (WObject *)WOBJ_arrayStartP(objPtr);
+			len = WOBJ_arrayLenP(objPtr);
 			for (i = 0; i < len; i++) {
-				o = arrayStart[i];
-				if (VALID_OBJ(o) && objectPtr(o) != NULL && !IS_MARKED(o)) {
-					MARK(o);
-					heap.hos[-(long)numScan].temp = o;
-					numScan++;
-				}
+				o = refs[i];
+				if (IS_LIVE_OBJ(o) && !IS_MARKED(o))
+					PUSH_MARK(o);
 			}
 		}
-	}
-	else {
-		// object
-		len = wclass->numVars;
-		for (i = 0; i < len; i++) {
-			o = WOBJ_var(obj, i).obj;
-			if (VALID_OBJ(o) && objectPtr(o) != NULL && !IS_MARKED(o)) {
-				MARK(o);
-				heap.hos[-(long)numScan].temp = o;
-				numScan++;
+		else {
+			// object - only the variables the class map says are references
+			wclass = (WClass *)objPtr[0].classRef;
+			refOffsets = wclass->refOffsets;
+			len = wclass->numRefs;
+			for (i = 0; i < len; i++) {
+				o = *(WObject *)WOBJ_fieldP(objPtr, refOffsets[i]);
+				if (IS_LIVE_OBJ(o) && !IS_MARKED(o))
+					PUSH_MARK(o);
 			}
 		}
 	}
-	if (numScan > 0) {
-		// Note: we use goto since we want to avoid recursion here
-		// since structures like linked links could create deep
-		// stack calls
-		--numScan;
-		obj = heap.hos[-(long)numScan].temp;
-		goto markinterior;
+}
+
+static unsigned long objectSizeOf(WObject obj) {
+	WClass *wclass;
+
+	wclass = WOBJ_class(obj);
+	if (wclass == NULL)
+		return arraySize(WOBJ_arrayType(obj), WOBJ_arrayLen(obj));
+	return WCLASS_objectSize(wclass);
+}
+
+unsigned long getObjectSize(WObject obj) {
+	return objectSizeOf(obj);
+}
+
+int isLiveObject(WObject obj) {
+	return IS_LIVE_OBJ(obj);
+}
+
+// call visit for every object in the heap (live or not yet collected)
+// in handle order. NOTE: visit must not allocate since that could run
+// the garbage collector.
+void walkObjects(ObjectVisitor visit, void *arg) {
+	unsigned long h;
+
+	for (h = 0; h < heap.numHandles; h++)
+		if (heap.hos[-(long)h].ptr != NULL)
+			visit(h + FIRST_OBJ + 1, arg);
+}
+
+#define ORDER(i) heap.hos[-(long)(i)].order
+#define ORDER_ADDR(i) heap.hos[-(long)ORDER(i)].ptr
+
+// heapsort the first n entries of the order array by object address.
+// Objects allocated in holes since the last sweep are out of order.
+static void sortHandles(unsigned long n) {
+	unsigned long start, end, root, child, h;
+
+	if (n < 2)
+		return;
+	start = n / 2;
+	end = n;
+	while (end > 1) {
+		if (start > 0)
+			start--;
+		else {
+			end--;
+			h = ORDER(end);
+			ORDER(end) = ORDER(0);
+			ORDER(0) = h;
+		}
+		root = start;
+		while ((child = 2 * root + 1) < end) {
+			if (child + 1 < end && ORDER_ADDR(child) < ORDER_ADDR(child + 1))
+				child++;
+			if (ORDER_ADDR(root) >= ORDER_ADDR(child))
+				break;
+			h = ORDER(root);
+			ORDER(root) = ORDER(child);
+			ORDER(child) = h;
+			root = child;
+		}
 	}
 }
 
@@ -232,14 +744,20 @@ markinterior:
 // This is because if a method was called, the object would be on its way to
 // being GC'd and if we set another object (or static field) to reference it,
 // after the GC, the reference would be stale.
+// NOTE: this is only called from gc() which starts the GcRecord
 void sweepObjects(void) {
 	WObject obj;
 	WClass *wclass;
-	unsigned long i, h, objSize, prevObjectSize, numUsedHandles;
-	unsigned char *src, *dst;
+	unsigned long i, h, top, prevObjectSize, numUsedHandles, objSize, startTime;
+	unsigned char *p;
+	Var *ptr;
 
-	prevObjectSize = heap.objectSize;
-	heap.objectSize = 0;
+	startTime = endGcPhase(&gcRecord->markTime, gcStartTime);
+
+	// the unused part of the allocation buffer is treated like the holes
+	// of dead objects and its reserved handles (unmarked since they don't
+	// point to anything) are freed below
+	dropAllocBuffer();
 
 	// move all the marks over into the scan array so we don't have
 	// to do lots of bit shifting
@@ -253,37 +771,28 @@ void sweepObjects(void) {
 		}
 	}
 	numUsedHandles = 0;
-	for (i = 0; i < heap.numHandles; i++) {
-		// we need to scan in memory order so we can compact things without
-		// copying objects over each other
-		h = heap.hos[-(long)i].order;
+	for (h = 0; h < heap.numHandles; h++) {
 		obj = h + FIRST_OBJ + 1;
 		if (heap.hos[-(long)h].temp == 0) {
 			// handle is free - dereference object
-			if (objectPtr(obj) != NULL) {
+			ptr = objectPtr(obj);
+			if (ptr != NULL) {
+				objSize = objectSizeOf(obj);
+				gcRecord->objectsFreed++;
+				gcRecord->bytesFreed += objSize;
 				wclass = WOBJ_class(obj);
 				// for non-arrays, call objDestroy if present
 				if (wclass != NULL && wclass->objDestroyFunc)
 					wclass->objDestroyFunc(obj);
+				if (IS_LARGE_PTR(ptr)) {
+					heap.largeObjectSize -= objSize;
+					mem_free(ptr);
+				}
 				heap.hos[-(long)h].ptr = NULL;
 			}
 			continue;
 		}
-		wclass = WOBJ_class(obj);
-		if (wclass == NULL)
-			objSize = arraySize(WOBJ_arrayType(obj), WOBJ_arrayLen(obj));
-		else
-			objSize = WCLASS_objectSize(wclass);
-
-		// copy object to new heap
-		src = (unsigned char *)heap.hos[-(long)h].ptr;
-		dst = &heap.mem[heap.objectSize];
-		if (src != dst)
-			// NOTE: overlapping regions need to copy correctly
-			memmove(dst, src, objSize);
-		heap.hos[-(long)h].ptr = (Var *)dst;
 		heap.hos[-(long)numUsedHandles].order = h;
-		heap.objectSize += objSize;
 		numUsedHandles++;
 	}
 	heap.numFreeHandles = heap.numHandles - numUsedHandles;
@@ -293,6 +802,77 @@ void sweepObjects(void) {
 			heap.hos[-(long)numUsedHandles].order = i;
 			numUsedHandles++;
 		}
+	numUsedHandles = heap.numHandles - heap.numFreeHandles;
+	sortHandles(numUsedHandles);
+
+	// rebuild the free lists from the gaps between the live objects.
+	// This also merges the holes of neighbouring dead objects and
+	// picks up the pieces too small to be linked in the last time.
+	clearFreeLists();
+	top = 0;
+	for (i = 0; i < numUsedHandles; i++) {
+		h = ORDER(i);
+		obj = h + FIRST_OBJ + 1;
+		p = (unsigned char *)heap.hos[-(long)h].ptr;
+		if (IS_LARGE_PTR(p))
+			continue;
+		if (p > &heap.mem[top])
+			addFreeChunk(&heap.mem[top], p - &heap.mem[top]);
+		top = (p - heap.mem) + objectSizeOf(obj);
+	}
+	// give the space after the last live object back to the top
+	// of the heap and zero out the part of the heap that is now junk
+	prevObjectSize = heap.objectSize;
+	heap.objectSize = top;
+	memset(&heap.mem[heap.objectSize], 0x00, prevObjectSize - heap.objectSize);
+
+	gcRecord->heapSize = heap.memSize;
+	gcRecord->liveHandles = numUsedHandles;
+	gcRecord->freeHandles = heap.numFreeHandles;
+	gcTotals.objectsFreed += gcRecord->objectsFreed;
+	gcTotals.bytesFreed += gcRecord->bytesFreed;
+	endGcPhase(&gcRecord->sweepTime, startTime);
+}
+
+// slide all live objects together at the bottom of the heap. This must
+// directly follow a sweepObjects() since it relies on the order array
+// being sorted by address.
+void compactObjects(void) {
+	WObject obj;
+	unsigned long i, h, objSize, prevObjectSize, numUsedHandles, bytesMoved, startTime;
+	unsigned char *src, *dst;
+
+	startTime = utils_get_usec();
+	bytesMoved = 0;
+	prevObjectSize = heap.objectSize;
+	heap.objectSize = 0;
+	numUsedHandles = heap.numHandles - heap.numFreeHandles;
+	for (i = 0; i < numUsedHandles; i++) {
+		// we need to move in memory order so we can compact things without
+		// copying objects over each other
+		h = ORDER(i);
+		obj = h + FIRST_OBJ + 1;
+		src = (unsigned char *)heap.hos[-(long)h].ptr;
+		if (IS_LARGE_PTR(src))
+			continue; // large objects stay where they are
+		objSize = objectSizeOf(obj);
+
+		// copy object to new heap
+		dst = &heap.mem[heap.objectSize];
+		if (src != dst) {
+			// NOTE: overlapping regions need to copy correctly
+			memmove(dst, src, objSize);
+			bytesMoved += objSize;
+		}
+		heap.hos[-(long)h].ptr = (Var *)dst;
+		heap.objectSize += objSize;
+	}
+	clearFreeLists();
 	// zero out the part of the heap that is now junk
 	memset(&heap.mem[heap.objectSize], 0x00, prevObjectSize - heap.objectSize);
+
+	gcTotals.numCompactions++;
+	gcTotals.bytesMoved += bytesMoved;
+	gcRecord->bytesMoved += bytesMoved;
+	endGcPhase(&gcRecord->compactTime, startTime);
 }
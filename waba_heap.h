@@ -9,19 +9,108 @@ extern "C" {
 
 unsigned long getUnusedMemSize(void);
 unsigned long getTotalMemSize(void);
+unsigned long getMaxMemSize(void);
+unsigned long getLargeObjectSize(void);
 unsigned long getNumHandles(void);
 
-int initObjectHeap(unsigned long heapSize);
+int initObjectHeap(unsigned long heapSize, unsigned long maxHeapSize);
 void freeObjectHeap(void);
 WObject allocObject(long size);
 Var *objectPtr(WObject obj);
 
+typedef void (*ObjectVisitor)(WObject obj, void *arg);
+
+unsigned long getObjectSize(WObject obj);
+int isLiveObject(WObject obj);
+void walkObjects(ObjectVisitor visit, void *arg);
+
 void markObject(WObject obj);
+void traceObjects(void);
 void sweepObjects(void);
+void compactObjects(void);
+
+// what started a collection, see gc()
+#define GC_REASON_ALLOC		0 // an object didn't fit in the heap
+#define GC_REASON_LARGE		1 // a large object didn't fit outside the heap
+#define GC_REASON_EXPLICIT	2 // System.gc()
+
+// statistics of a single collection. Times are in microseconds.
+typedef struct {
+	unsigned long reason;
+	unsigned long heapSize; // after the collection
+	unsigned long markTime;
+	unsigned long sweepTime;
+	unsigned long compactTime; // compaction and heap resizing
+	unsigned long bytesMoved; // by compaction and heap resizing
+	unsigned long objectsFreed;
+	unsigned long bytesFreed;
+	unsigned long liveHandles;
+	unsigned long freeHandles;
+} GcRecord;
+
+// number of ints System.getGcHistory() puts in the array for each
+// record, like System.GC_RECORD_SIZE
+#define GC_RECORD_SIZE	10
+
+// statistics since the heap was created
+typedef struct {
+	unsigned long numGcs;
+	unsigned long numCompactions;
+	unsigned long numResizes;
+	unsigned long pauseTime;
+	unsigned long maxPauseTime;
+	unsigned long bytesAllocated;
+	unsigned long objectsAllocated;
+	unsigned long bytesFreed;
+	unsigned long objectsFreed;
+	unsigned long bytesMoved;
+} GcTotals;
+
+// number of ints System.getGcTotals() fills in, like System.GC_TOTALS_SIZE
+#define GC_TOTALS_SIZE	10
+
+// number of collections kept in the history
+#define GC_HISTORY_SIZE	16
+
+void beginGcRecord(unsigned long reason);
+void getGcTotals(GcTotals *totals);
+unsigned long getGcHistory(GcRecord *records, unsigned long maxRecords);
 
 #define FIRST_OBJ 2244
 #define VALID_OBJ(o) (o > FIRST_OBJ && o <= FIRST_OBJ + getNumHandles() )
 
+// The allocation buffer is a piece of the top of the heap together with
+// a few handles reserved for it. Objects are carved out of it by bumping
+// a pointer (see allocObjectFast()) and only when it is used up does the
+// allocation go through allocObject(), which hands out a new buffer.
+// NOTE: the buffer is dropped by every sweep, its unused space and
+// handles are then reclaimed like those of dead objects.
+#define ALLOC_BUFFER_SIZE		512
+#define ALLOC_BUFFER_HANDLES	32
+
+typedef struct {
+	unsigned char *top; // next free byte
+	unsigned char *end;
+	Hos *hos;
+	unsigned long numHandles; // reserved handles left
+	unsigned long handles[ALLOC_BUFFER_HANDLES];
+} AllocBuffer;
+
+extern AllocBuffer allocBuffer;
+
+// returns WOBJECT_NULL when the object doesn't fit in what is left of
+// the allocation buffer (the memory returned is zeroed)
+static inline WObject allocObjectFast(unsigned long size) {
+	unsigned long h;
+
+	if (allocBuffer.numHandles == 0 || (unsigned long)(allocBuffer.end - allocBuffer.top) < size)
+		return WOBJECT_NULL;
+	h = allocBuffer.handles[--allocBuffer.numHandles];
+	allocBuffer.hos[-(long)h].ptr = (Var *)allocBuffer.top;
+	allocBuffer.top += size;
+	return FIRST_OBJ + h + 1;
+}
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
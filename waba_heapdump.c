@@ -0,0 +1,269 @@
+#include "waba.h"
+#include "utils.h"
+#include "waba_utf.h"
+#include "waba_heap.h"
+#include "waba_heapdump.h"
+#include "debuglog.h"
+#include <stdio.h>
+#include <string.h>
+
+//
+// Heap Histogram and Dump
+//
+
+// The histogram counts the objects in the heap by class, arrays are
+// counted by their element type. Two histograms taken at different
+// points can be compared with printHeapHistogramDiff().
+//
+// The dump is a text file for looking at offline. It has one line per
+// object with the objects it refers to so the object graph can be
+// rebuilt, followed by the GC roots:
+//
+// WABAHEAP 1
+// heap <total> <unused> <large> <handles>
+// class <name> <count> <bytes>
+// object <handle> <name> <size> [<handle> ...]
+// root <vm|nm|static> <handle>
+// end
+//
+// NOTE: like the garbage collector, the references on the vm stack are
+// found conservatively so an int that happens to be a valid handle
+// shows up as a root.
+
+// the file System.dumpHeap() writes. Only the host sets it, Java can't
+// choose the path so it can't write to any other file.
+static const char *heapDumpPath = NULL;
+
+static const char *arrayTypeName(unsigned char type) {
+	switch (type) {
+	case TYPE_OBJECT: return "[Ljava/lang/Object;";
+	case TYPE_ARRAY: return "[[";
+	case TYPE_BOOLEAN: return "[Z";
+	case TYPE_CHAR: return "[C";
+	case TYPE_FLOAT: return "[F";
+	case TYPE_DOUBLE: return "[D";
+	case TYPE_BYTE: return "[B";
+	case TYPE_SHORT: return "[S";
+	case TYPE_INT: return "[I";
+	case TYPE_LONG: return "[J";
+	}
+	return "[?";
+}
+
+// the name of a histogram entry as a length and pointer for "%.*s"
+static const char *entryName(WClass *wclass, unsigned char arrayType, int *len) {
+	UtfString name;
+
+	if (wclass == NULL) {
+		*len = (int)strlen(arrayTypeName(arrayType));
+		return arrayTypeName(arrayType);
+	}
+	name = getUtfString(wclass, wclass->classNameIndex);
+	*len = (int)name.len;
+	return name.str;
+}
+
+static void countObject(WObject obj, void *arg) {
+	HeapHistogram *histogram;
+	HeapHistogramEntry *entry;
+	WClass *wclass;
+	unsigned char arrayType;
+	unsigned long i, size;
+
+	histogram = (HeapHistogram *)arg;
+	wclass = WOBJ_class(obj);
+	arrayType = (wclass == NULL) ? WOBJ_arrayType(obj) : 0;
+	size = getObjectSize(obj);
+	histogram->numObjects++;
+	histogram->numBytes += size;
+
+	for (i = 0; i < histogram->numEntries; i++) {
+		entry = &histogram->entries[i];
+		if (entry->wclass == wclass && entry->arrayType == arrayType)
+			break;
+	}
+	if (i == histogram->numEntries) {
+		if (i == HEAP_HISTOGRAM_SIZE) {
+			histogram->otherCount++;
+			histogram->otherBytes += size;
+			return;
+		}
+		entry = &histogram->entries[histogram->numEntries++];
+		entry->wclass = wclass;
+		entry->arrayType = arrayType;
+		entry->count = 0;
+		entry->bytes = 0;
+	}
+	entry->count++;
+	entry->bytes += size;
+}
+
+void takeHeapHistogram(HeapHistogram *histogram) {
+	HeapHistogramEntry entry;
+	unsigned long i, j;
+
+	memset(histogram, 0x00, sizeof(HeapHistogram));
+	walkObjects(countObject, histogram);
+
+	// sort by size, largest first (there are only a few entries)
+	for (i = 1; i < histogram->numEntries; i++) {
+		entry = histogram->entries[i];
+		for (j = i; j > 0 && histogram->entries[j - 1].bytes < entry.bytes; j--)
+			histogram->entries[j] = histogram->entries[j - 1];
+		histogram->entries[j] = entry;
+	}
+}
+
+void printHeapHistogram(const HeapHistogram *histogram) {
+	const HeapHistogramEntry *entry;
+	const char *name;
+	unsigned long i;
+	int len;
+
+	debuglog("%8s %10s  %s\n", "count", "bytes", "class");
+	for (i = 0; i < histogram->numEntries; i++) {
+		entry = &histogram->entries[i];
+		name = entryName(entry->wclass, entry->arrayType, &len);
+		debuglog("%8lu %10lu  %.*s\n", entry->count, entry->bytes, len, name);
+	}
+	if (histogram->otherCount)
+		debuglog("%8lu %10lu  (other)\n", histogram->otherCount, histogram->otherBytes);
+	debuglog("%8lu %10lu  (total)\n", histogram->numObjects, histogram->numBytes);
+}
+
+static const HeapHistogramEntry *findEntry(const HeapHistogram *histogram, const HeapHistogramEntry *entry) {
+	unsigned long i;
+
+	for (i = 0; i < histogram->numEntries; i++)
+		if (histogram->entries[i].wclass == entry->wclass &&
+			histogram->entries[i].arrayType == entry->arrayType)
+			return &histogram->entries[i];
+	return NULL;
+}
+
+// print the change in count and bytes of every class that changed
+// between the two histograms
+void printHeapHistogramDiff(const HeapHistogram *before, const HeapHistogram *after) {
+	const HeapHistogramEntry *entry, *prev;
+	const char *name;
+	unsigned long i;
+	long count, bytes;
+	int len;
+
+	debuglog("%8s %10s  %s\n", "count", "bytes", "class");
+	for (i = 0; i < after->numEntries; i++) {
+		entry = &after->entries[i];
+		prev = findEntry(before, entry);
+		count = (long)entry->count - (prev != NULL ? (long)prev->count : 0);
+		bytes = (long)entry->bytes - (prev != NULL ? (long)prev->bytes : 0);
+		if (count == 0 && bytes == 0)
+			continue;
+		name = entryName(entry->wclass, entry->arrayType, &len);
+		debuglog("%+8ld %+10ld  %.*s\n", count, bytes, len, name);
+	}
+	// classes that are gone altogether
+	for (i = 0; i < before->numEntries; i++) {
+		entry = &before->entries[i];
+		if (findEntry(after, entry) != NULL)
+			continue;
+		name = entryName(entry->wclass, entry->arrayType, &len);
+		debuglog("%+8ld %+10ld  %.*s\n", -(long)entry->count, -(long)entry->bytes, len, name);
+	}
+	debuglog("%+8ld %+10ld  (total)\n",
+		(long)after->numObjects - (long)before->numObjects,
+		(long)after->numBytes - (long)before->numBytes);
+}
+
+// print the memory totals and what is in the heap. This is called when
+// the heap runs out of memory so it must not allocate anything.
+void printHeapStatus(void) {
+	static HeapHistogram histogram;
+	T_MEMINFO info;
+
+	getMemInfo(&info);
+	debuglog("object heap: total=%lu unused=%lu large=%lu handles=%lu\n",
+		info.totalObjectMem, info.unusedObjectMem, info.largeObjectMem, getNumHandles());
+	takeHeapHistogram(&histogram);
+	printHeapHistogram(&histogram);
+}
+
+static void dumpObject(WObject obj, void *arg) {
+	FILE *fp;
+	WClass *wclass;
+	WObject *refs, ref;
+	const char *name;
+	unsigned long i;
+	int len;
+
+	fp = (FILE *)arg;
+	wclass = WOBJ_class(obj);
+	if (wclass == NULL) {
+		name = entryName(NULL, WOBJ_arrayType(obj), &len);
+		fprintf(fp, "object %lu %.*s %lu", (unsigned long)obj, len, name, getObjectSize(obj));
+		if (WOBJ_arrayType(obj) == TYPE_OBJECT || WOBJ_arrayType(obj) == TYPE_ARRAY) {
+			refs = (WObject *)WOBJ_arrayStart(obj);
+			for (i = 0; i < (unsigned long)WOBJ_arrayLen(obj); i++)
+				if (isLiveObject(refs[i]))
+					fprintf(fp, " %lu", (unsigned long)refs[i]);
+		}
+	}
+	else {
+		name = entryName(wclass, 0, &len);
+		fprintf(fp, "object %lu %.*s %lu", (unsigned long)obj, len, name, getObjectSize(obj));
+		for (i = 0; i < wclass->numRefs; i++) {
+			ref = *(WObject *)WOBJ_field(obj, wclass->refOffsets[i]);
+			if (isLiveObject(ref))
+				fprintf(fp, " %lu", (unsigned long)ref);
+		}
+	}
+	fprintf(fp, "\n");
+}
+
+static void dumpRoot(WObject obj, unsigned long kind, void *arg) {
+	static const char *kindNames[] = { "vm", "nm", "static" };
+
+	if (isLiveObject(obj))
+		fprintf((FILE *)arg, "root %s %lu\n", kindNames[kind], (unsigned long)obj);
+}
+
+// write a heap dump to the file at path (see the format above)
+long dumpHeap(const char *path) {
+	static HeapHistogram histogram;
+	const HeapHistogramEntry *entry;
+	const char *name;
+	T_MEMINFO info;
+	FILE *fp;
+	unsigned long i;
+	int len;
+
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		return FT_ERR_FAILED;
+
+	getMemInfo(&info);
+	fprintf(fp, "WABAHEAP 1\n");
+	fprintf(fp, "heap %lu %lu %lu %lu\n", info.totalObjectMem, info.unusedObjectMem,
+		info.largeObjectMem, getNumHandles());
+	takeHeapHistogram(&histogram);
+	for (i = 0; i < histogram.numEntries; i++) {
+		entry = &histogram.entries[i];
+		name = entryName(entry->wclass, entry->arrayType, &len);
+		fprintf(fp, "class %.*s %lu %lu\n", len, name, entry->count, entry->bytes);
+	}
+	walkObjects(dumpObject, fp);
+	walkRoots(dumpRoot, fp);
+	fprintf(fp, "end\n");
+
+	if (fclose(fp) != 0)
+		return FT_ERR_FAILED;
+	return FT_ERR_OK;
+}
+
+// NULL turns System.dumpHeap() off, the path must stay valid while set
+void setHeapDumpPath(const char *path) {
+	heapDumpPath = path;
+}
+
+const char *getHeapDumpPath(void) {
+	return heapDumpPath;
+}
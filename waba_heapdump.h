@@ -0,0 +1,42 @@
+#ifndef _WABA_HEAPDUMP_H_
+#define _WABA_HEAPDUMP_H_
+
+#include "waba.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// number of classes (and array types) a histogram keeps apart. The
+// objects of any further classes are only counted in otherCount/Bytes.
+#define HEAP_HISTOGRAM_SIZE	64
+
+typedef struct {
+	WClass *wclass; // NULL for arrays
+	unsigned char arrayType;
+	unsigned long count;
+	unsigned long bytes;
+} HeapHistogramEntry;
+
+typedef struct {
+	unsigned long numObjects;
+	unsigned long numBytes;
+	unsigned long otherCount;
+	unsigned long otherBytes;
+	unsigned long numEntries;
+	HeapHistogramEntry entries[HEAP_HISTOGRAM_SIZE]; // largest first
+} HeapHistogram;
+
+void takeHeapHistogram(HeapHistogram *histogram);
+void printHeapHistogram(const HeapHistogram *histogram);
+void printHeapHistogramDiff(const HeapHistogram *before, const HeapHistogram *after);
+void printHeapStatus(void);
+long dumpHeap(const char *path);
+void setHeapDumpPath(const char *path);
+const char *getHeapDumpPath(void);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif
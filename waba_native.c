@@ -5,6 +5,9 @@
 #include "alloc_class.h"
 #include "debuglog.h"
 #include "waba_util.h"
+#include "waba_heap.h"
+#include "waba_heapdump.h"
+#include "waba_stream.h"
 #include <string.h>
 #include <stdlib.h>
 
@@ -14,10 +17,93 @@
 
 extern unsigned char *inoutBuff_ext;
 extern unsigned long inoutBuffSize_ext;
+extern const unsigned char *binInput_ext;
+extern unsigned long binInputSize_ext;
+extern unsigned char *binOutput_ext;
+extern unsigned long binOutputSize_ext;
+extern unsigned long binOutputLength_ext;
 
 // base/framework/System_gc_()V
 long FCSystem_gc(Var stack[]){
-	gc();
+	gc(GC_REASON_EXPLICIT);
+	return 0;
+}
+
+// base/framework/System_getGcTotals_([I)I
+long FCSystem_getGcTotals(Var stack[]){
+	GcTotals totals;
+	unsigned long values[GC_TOTALS_SIZE];
+	long *ints;
+	long i, len;
+
+	if( stack[0].obj == WOBJECT_NULL )
+		return ERR_NullObjectAccess;
+
+	getGcTotals(&totals);
+	values[0] = totals.numGcs;
+	values[1] = totals.numCompactions;
+	values[2] = totals.numResizes;
+	values[3] = totals.pauseTime;
+	values[4] = totals.maxPauseTime;
+	values[5] = totals.bytesAllocated;
+	values[6] = totals.objectsAllocated;
+	values[7] = totals.bytesFreed;
+	values[8] = totals.objectsFreed;
+	values[9] = totals.bytesMoved;
+
+	len = WOBJ_arrayLen(stack[0].obj);
+	if( len > GC_TOTALS_SIZE )
+		len = GC_TOTALS_SIZE;
+	ints = (long *)WOBJ_arrayStart(stack[0].obj);
+	for( i = 0; i < len; i++ )
+		ints[i] = values[i];
+
+	stack[0].intValue = len;
+	return 0;
+}
+
+// base/framework/System_getGcHistory_([I)I
+long FCSystem_getGcHistory(Var stack[]){
+	GcRecord records[GC_HISTORY_SIZE];
+	long *ints;
+	unsigned long i, num;
+
+	if( stack[0].obj == WOBJECT_NULL )
+		return ERR_NullObjectAccess;
+
+	// only whole records are copied
+	num = getGcHistory(records, WOBJ_arrayLen(stack[0].obj) / GC_RECORD_SIZE);
+	ints = (long *)WOBJ_arrayStart(stack[0].obj);
+	for( i = 0; i < num; i++, ints += GC_RECORD_SIZE ){
+		ints[0] = records[i].reason;
+		ints[1] = records[i].heapSize;
+		ints[2] = records[i].markTime;
+		ints[3] = records[i].sweepTime;
+		ints[4] = records[i].compactTime;
+		ints[5] = records[i].bytesMoved;
+		ints[6] = records[i].objectsFreed;
+		ints[7] = records[i].bytesFreed;
+		ints[8] = records[i].liveHandles;
+		ints[9] = records[i].freeHandles;
+	}
+
+	stack[0].intValue = num;
+	return 0;
+}
+
+// base/framework/System_printHeapHistogram_()V
+long FCSystem_printHeapHistogram(Var stack[]){
+	printHeapStatus();
+	return 0;
+}
+
+// base/framework/System_dumpHeap_()Z
+long FCSystem_dumpHeap(Var stack[]){
+	const char *path;
+
+	// to the file the host chose, false if it didn't
+	path = getHeapDumpPath();
+	stack[0].intValue = ( path != NULL && dumpHeap( path ) == FT_ERR_OK ) ? 1 : 0;
 	return 0;
 }
 
@@ -149,32 +235,31 @@ long FCSystem_arrayCopy(Var stack[]){
 
 // base/framework/Convert_toInt_(Ljava/lang/String;)I
 long Convert_StringToInt(Var stack[]){
-	WObject string, charArray;
+	WObject string;
 	long i, isNeg, len, value;
-	unsigned short *chars;
+	unsigned short c;
 	Var v;
 
 	v.intValue = 0;
 	string = stack[0].obj;
 	if (string == WOBJECT_NULL)
 		return ERR_NullObjectAccess;
-	charArray = WOBJ_StringCharArrayObj(string);
-	if (charArray == WOBJECT_NULL)
+	len = getStringLength(string);
+	if (len < 0)
 		return ERR_NullObjectAccess;
-	chars = (unsigned short *)WOBJ_arrayStart(charArray);
-	len = WOBJ_arrayLen(charArray);
 
 	// NOTE: We do it all here instead of calling atoi() since it looks
 	// like various versions of CE don't support atoi(). It's also faster
 	// this way since we don't have to convert to a byte array.
 	isNeg = 0;
-	if (len > 0 && chars[0] == '-')
+	if (len > 0 && getStringChar(string, 0) == '-')
 		isNeg = 1;
 	value = 0;
 	for (i = isNeg; i < len; i++){
-		if (chars[i] < (unsigned short)'0' || chars[i] > (unsigned short)'9')
+		c = getStringChar(string, i);
+		if (c < (unsigned short)'0' || c > (unsigned short)'9')
 			return 1;
-		value = (value * 10) + ((long)chars[i] - (long)'0');
+		value = (value * 10) + ((long)c - (long)'0');
 	}
 	if (isNeg)
 		value = -(value);
@@ -196,14 +281,46 @@ long Convert_IntToString(Var stack[]){
 	return 0;
 }
 
+// base/framework/Convert_toString_(J)Ljava/lang/String;
+long Convert_LongToString(Var stack[]){
+	Var v;
+	char buf[24];
+
+	utils_lltoa( getInt64(stack), buf, 10 );
+	v.obj = createString(buf);
+	stack[0] = v;
+	return 0;
+}
+
+// base/framework/Convert_toString_(F)Ljava/lang/String;
+long Convert_FloatToString(Var stack[]){
+	Var v;
+	char buf[32];
+
+	utils_dtoa( stack[0].floatValue, buf, 1 );
+	v.obj = createString(buf);
+	stack[0] = v;
+	return 0;
+}
+
+// base/framework/Convert_toString_(D)Ljava/lang/String;
+long Convert_DoubleToString(Var stack[]){
+	Var v;
+	char buf[32];
+
+	utils_dtoa( getFloat64(stack), buf, 0 );
+	v.obj = createString(buf);
+	stack[0] = v;
+	return 0;
+}
+
 // base/framework/Convert_toString_(C)Ljava/lang/String;
 long Convert_CharToString(Var stack[]){
 	Var v;
-	char buf[2];
+	unsigned short c;
 
-	buf[0] = (char)stack[0].intValue;
-	buf[1] = 0;
-	v.obj = createString(buf);
+	c = (unsigned short)stack[0].intValue;
+	v.obj = createStringFromChars(&c, 1);
 
 	stack[0] = v;
 	return 0;
@@ -224,6 +341,200 @@ long Convert_BooleanToString(Var stack[]){
 	return 0;
 }
 
+//
+// StringBuilder
+//
+
+// java/lang/StringBuilder and java/lang/StringBuffer have the same
+// variables: a growable byte array that holds the characters the same
+// way as String.value, the number of characters and the coder.
+
+// make room for len more characters of the given coder. The characters
+// are widened to UTF16 when a UTF16 character is added to a LATIN1 buffer.
+static long growStringBuilder(WObject sb, long len, unsigned char coder) {
+	WObject value, newValue;
+	unsigned char *src, *dst, oldCoder;
+	long i, count, capacity;
+
+	value = WOBJ_StringBuilderValue(sb);
+	if (value == WOBJECT_NULL)
+		return ERR_NullObjectAccess;
+	count = WOBJ_StringBuilderCount(sb);
+	oldCoder = WOBJ_StringBuilderCoder(sb);
+	if (coder < oldCoder)
+		coder = oldCoder;
+	capacity = WOBJ_arrayLen(value) >> oldCoder;
+	if (count + len <= capacity && coder == oldCoder)
+		return 0;
+	if (count + len > capacity) {
+		capacity = capacity * 2 + 2;
+		if (capacity < count + len)
+			capacity = count + len;
+	}
+
+	newValue = createArrayObject(TYPE_BYTE, capacity << coder);
+	if (newValue == WOBJECT_NULL)
+		return ERR_OutOfObjectMem;
+	// NOTE: get the pointers after the allocation since it may move objects
+	src = (unsigned char *)WOBJ_arrayStart(value);
+	dst = (unsigned char *)WOBJ_arrayStart(newValue);
+	if (coder == oldCoder)
+		memcpy(dst, src, count << coder);
+	else {
+		for (i = 0; i < count; i++) {
+			dst[i * 2] = src[i];
+			dst[i * 2 + 1] = 0;
+		}
+	}
+	WOBJ_StringBuilderValue(sb) = newValue;
+	WOBJ_StringBuilderCoder(sb) = coder;
+	return 0;
+}
+
+// append len Latin-1 characters that are not in the object heap
+static long appendLatin1(WObject sb, const char *s, long len) {
+	unsigned char *dst;
+	long i, count, ret;
+
+	ret = growStringBuilder(sb, len, STRING_LATIN1);
+	if (ret != 0)
+		return ret;
+	count = WOBJ_StringBuilderCount(sb);
+	dst = (unsigned char *)WOBJ_arrayStart(WOBJ_StringBuilderValue(sb));
+	if (WOBJ_StringBuilderCoder(sb) == STRING_LATIN1)
+		memcpy(&dst[count], s, len);
+	else {
+		for (i = 0; i < len; i++) {
+			dst[(count + i) * 2] = (unsigned char)s[i];
+			dst[(count + i) * 2 + 1] = 0;
+		}
+	}
+	WOBJ_StringBuilderCount(sb) = count + len;
+	return 0;
+}
+
+// java/lang/StringBuilder_append_(Ljava/lang/String;)Ljava/lang/StringBuilder;
+long StringBuilder_appendString(Var stack[]) {
+	WObject sb, string;
+	unsigned char *src, *dst, coder;
+	long i, len, count, ret;
+
+	sb = stack[0].obj;
+	string = stack[1].obj;
+	if (string == WOBJECT_NULL)
+		return 0;
+	len = getStringLength(string);
+	if (len < 0)
+		return ERR_NullObjectAccess;
+	coder = WOBJ_StringCoder(string);
+	ret = growStringBuilder(sb, len, coder);
+	if (ret != 0)
+		return ret;
+
+	count = WOBJ_StringBuilderCount(sb);
+	src = (unsigned char *)WOBJ_arrayStart(WOBJ_StringValueObj(string));
+	dst = (unsigned char *)WOBJ_arrayStart(WOBJ_StringBuilderValue(sb));
+	if (WOBJ_StringBuilderCoder(sb) == coder)
+		memcpy(&dst[count << coder], src, len << coder);
+	else {
+		// a LATIN1 string to a UTF16 buffer
+		for (i = 0; i < len; i++) {
+			dst[(count + i) * 2] = src[i];
+			dst[(count + i) * 2 + 1] = 0;
+		}
+	}
+	WOBJ_StringBuilderCount(sb) = count + len;
+	return 0;
+}
+
+// java/lang/StringBuilder_append_(I)Ljava/lang/StringBuilder;
+long StringBuilder_appendInt(Var stack[]) {
+	char buf[20];
+
+	utils_ltoa(stack[1].intValue, buf, 10);
+	return appendLatin1(stack[0].obj, buf, (long)strlen(buf));
+}
+
+// java/lang/StringBuilder_append_(J)Ljava/lang/StringBuilder;
+long StringBuilder_appendLong(Var stack[]) {
+	char buf[24];
+
+	utils_lltoa(getInt64(&stack[1]), buf, 10);
+	return appendLatin1(stack[0].obj, buf, (long)strlen(buf));
+}
+
+// java/lang/StringBuilder_append_(F)Ljava/lang/StringBuilder;
+long StringBuilder_appendFloat(Var stack[]) {
+	char buf[32];
+
+	utils_dtoa(stack[1].floatValue, buf, 1);
+	return appendLatin1(stack[0].obj, buf, (long)strlen(buf));
+}
+
+// java/lang/StringBuilder_append_(D)Ljava/lang/StringBuilder;
+long StringBuilder_appendDouble(Var stack[]) {
+	char buf[32];
+
+	utils_dtoa(getFloat64(&stack[1]), buf, 0);
+	return appendLatin1(stack[0].obj, buf, (long)strlen(buf));
+}
+
+// java/lang/StringBuilder_append_(C)Ljava/lang/StringBuilder;
+long StringBuilder_appendChar(Var stack[]) {
+	WObject sb;
+	unsigned char *dst;
+	unsigned short c;
+	long count, ret;
+	char b;
+
+	sb = stack[0].obj;
+	c = (unsigned short)stack[1].intValue;
+	if (c <= 0xFF) {
+		b = (char)c;
+		return appendLatin1(sb, &b, 1);
+	}
+	ret = growStringBuilder(sb, 1, STRING_UTF16);
+	if (ret != 0)
+		return ret;
+	count = WOBJ_StringBuilderCount(sb);
+	dst = (unsigned char *)WOBJ_arrayStart(WOBJ_StringBuilderValue(sb));
+	dst[count * 2] = (unsigned char)c;
+	dst[count * 2 + 1] = (unsigned char)(c >> 8);
+	WOBJ_StringBuilderCount(sb) = count + 1;
+	return 0;
+}
+
+// java/lang/StringBuilder_append_(Z)Ljava/lang/StringBuilder;
+long StringBuilder_appendBoolean(Var stack[]) {
+	if (stack[1].intValue == 0)
+		return appendLatin1(stack[0].obj, "false", 5);
+	return appendLatin1(stack[0].obj, "true", 4);
+}
+
+// java/lang/StringBuilder_toString_()Ljava/lang/String;
+long StringBuilder_toString(Var stack[]) {
+	WObject sb, value;
+	unsigned char coder;
+	long count;
+	Var v;
+
+	sb = stack[0].obj;
+	if (WOBJ_StringBuilderValue(sb) == WOBJECT_NULL)
+		return ERR_NullObjectAccess;
+	count = WOBJ_StringBuilderCount(sb);
+	coder = WOBJ_StringBuilderCoder(sb);
+	value = createArrayObject(TYPE_BYTE, count << coder);
+	if (value == WOBJECT_NULL)
+		return ERR_OutOfObjectMem;
+	memcpy(WOBJ_arrayStart(value), WOBJ_arrayStart(WOBJ_StringBuilderValue(sb)), count << coder);
+	v.obj = createStringFromValue(value, coder);
+	if (v.obj == WOBJECT_NULL)
+		return ERR_OutOfObjectMem;
+
+	stack[0] = v;
+	return 0;
+}
+
 // base/framework/FCSystem_sleep_(I)I
 long FCSystem_sleep(Var stack[]) {
 	Var v;
@@ -270,6 +581,8 @@ long FCSystem_hasClass(Var stack[]){
 		return ERR_NullObjectAccess;
 
 	utf = stringToUtf( stack[0].obj, STU_USE_STATIC | STU_NULL_TERMINATE );
+	if( utf.str == NULL )
+		return ERR_ParamError;
 	if( getClass( utf ) != NULL )
 		v.intValue = 1;
 	else
@@ -283,8 +596,14 @@ long FCSystem_hasClass(Var stack[]){
 long FCSystem_print(Var stack[]){
 	UtfString utf;
 
+	if( stack[0].obj == WOBJECT_NULL )
+		return ERR_NullObjectAccess;
+
+	// NULL if it is longer than a UtfString can hold
 	utf = stringToUtf( stack[0].obj, STU_USE_STATIC | STU_NULL_TERMINATE );
-	debuglog( utf.str );
+	if( utf.str == NULL )
+		return ERR_ParamError;
+	debuglog( "%s", utf.str );
 
 	return 0;
 }
@@ -301,6 +620,8 @@ long FCSystem_newInstance(Var stack[]){
 		return ERR_NullObjectAccess;
 
 	utf = stringToUtf( stack[0].obj, STU_USE_STATIC | STU_NULL_TERMINATE );
+	if( utf.str == NULL )
+		return ERR_ParamError;
 	baseutf = createUtfString("");
 
 	ret = newClass( utf, baseutf, &retType, &v );
@@ -364,13 +685,11 @@ long FCSystem_getInput(Var stack[]) {
 
 // base/framework/System_setOutput_([Ljava/lang/String;)V
 long FCSystem_setOutput(Var stack[]) {
-	WObject strArray, charArray;
+	WObject strArray;
 	WObject *obj;
 	long len;
-	unsigned short *chars;
 	unsigned long ptr;
 	unsigned char i;
-	long j;
 
 	if (inoutBuff_ext == NULL)
 		return ERR_NullObjectAccess;
@@ -384,17 +703,16 @@ long FCSystem_setOutput(Var stack[]) {
 	obj = (WObject *)WOBJ_arrayStart(strArray);
 	ptr = 1;
 	for (i = 0; i < num; i++) {
-		charArray = WOBJ_StringCharArrayObj(obj[i]);
-		if (charArray == WOBJECT_NULL)
+		if (obj[i] == WOBJECT_NULL)
+			return ERR_NullObjectAccess;
+		len = getStringUtfLength(obj[i]);
+		if (len < 0)
 			return ERR_NullObjectAccess;
-		chars = (unsigned short *)WOBJ_arrayStart(charArray);
-		len = WOBJ_arrayLen(charArray);
 
 		if ((ptr + len + 1) > inoutBuffSize_ext)
 			return ERR_OutOfObjectMem;
 
-		for (j = 0; j < len; j++)
-			inoutBuff_ext[ptr + j] = (unsigned char)chars[j];
+		getStringUtf(obj[i], &inoutBuff_ext[ptr]);
 		inoutBuff_ext[ptr + len] = '\0';
 		ptr += len + 1;
 	}
@@ -404,59 +722,319 @@ long FCSystem_setOutput(Var stack[]) {
 	return 0;
 }
 
-// This array is used to map a hash value to a corresponding native function.
-// It must remain sorted by hash value because a binary search is performed
-// to find a method by its hash value. There is a small chance of collision
-// if two hashes match and if one occurs, the function name should be changed
-// to avoid collision. To prevent users from creating invalid native methods
-// that hash to a valid value, native methods could be restricted to a specific
-// set of classes (this is probably not necessary since any verifier probably
-// wouldn't allow native methods to get by anyway).
+// The binary input and output regions are given by the host (see
+// setBinaryInput() and setBinaryOutput()). The bytes are copied straight
+// between them and Java byte arrays, without going through Strings.
+
+// base/framework/System_getInputSize_()I
+long FCSystem_getInputSize(Var stack[]) {
+	Var v;
+
+	v.intValue = (long)binInputSize_ext;
+	stack[0] = v;
+
+	return 0;
+}
+
+// base/framework/System_readInput_(I[BII)I
+long FCSystem_readInput(Var stack[]) {
+	Var v;
+	WObject byteArray;
+	long pos, off, len;
+
+	byteArray = stack[1].obj;
+	if (byteArray == WOBJECT_NULL)
+		return ERR_NullObjectAccess;
+	pos = stack[0].intValue;
+	off = stack[2].intValue;
+	len = stack[3].intValue;
+	if (pos < 0 || arrayRangeCheck(byteArray, off, len) == 0)
+		return ERR_IndexOutOfRange;
+
+	// -1 at the end of the input like InputStream.read()
+	if ((unsigned long)pos >= binInputSize_ext && len > 0) {
+		v.intValue = -1;
+		stack[0] = v;
+		return 0;
+	}
+	if ((unsigned long)len > binInputSize_ext - pos)
+		len = binInputSize_ext - pos;
+	if (len > 0)
+		memcpy((unsigned char *)WOBJ_arrayStart(byteArray) + off, binInput_ext + pos, len);
+
+	v.intValue = len;
+	stack[0] = v;
+
+	return 0;
+}
+
+// base/framework/System_writeOutput_([BII)I
+long FCSystem_writeOutput(Var stack[]) {
+	Var v;
+	WObject byteArray;
+	long off, len;
+
+	if (binOutput_ext == NULL)
+		return ERR_CondNotSatisfied;
+	byteArray = stack[0].obj;
+	if (byteArray == WOBJECT_NULL)
+		return ERR_NullObjectAccess;
+	off = stack[1].intValue;
+	len = stack[2].intValue;
+	if (arrayRangeCheck(byteArray, off, len) == 0)
+		return ERR_IndexOutOfRange;
+
+	// only what fits, the caller sees it from the count
+	if ((unsigned long)len > binOutputSize_ext - binOutputLength_ext)
+		len = binOutputSize_ext - binOutputLength_ext;
+	memcpy(binOutput_ext + binOutputLength_ext, (unsigned char *)WOBJ_arrayStart(byteArray) + off, len);
+	binOutputLength_ext += len;
+
+	v.intValue = len;
+	stack[0] = v;
+
+	return 0;
+}
+
+// base/framework/System_readStream_([BII)I
+long FCSystem_readStream(Var stack[]) {
+	Var v;
+	WObject byteArray;
+
+	byteArray = stack[0].obj;
+	if (byteArray == WOBJECT_NULL)
+		return ERR_NullObjectAccess;
+	if (arrayRangeCheck(byteArray, stack[1].intValue, stack[2].intValue) == 0)
+		return ERR_IndexOutOfRange;
+
+	v.intValue = streamRead((unsigned char *)WOBJ_arrayStart(byteArray) + stack[1].intValue,
+		stack[2].intValue);
+	stack[0] = v;
+
+	return 0;
+}
+
+// base/framework/System_writeStream_([BII)I
+long FCSystem_writeStream(Var stack[]) {
+	Var v;
+	WObject byteArray;
+
+	byteArray = stack[0].obj;
+	if (byteArray == WOBJECT_NULL)
+		return ERR_NullObjectAccess;
+	if (arrayRangeCheck(byteArray, stack[1].intValue, stack[2].intValue) == 0)
+		return ERR_IndexOutOfRange;
+
+	v.intValue = (long)streamWrite((unsigned char *)WOBJ_arrayStart(byteArray) + stack[1].intValue,
+		stack[2].intValue);
+	stack[0] = v;
+
+	return 0;
+}
+
+// base/framework/System_flushStream_()V
+long FCSystem_flushStream(Var stack[]) {
+	streamFlush();
+	return 0;
+}
+
+// The native methods of the class library, they are put in the native
+// method registry (see findNativeMethod()) the first time it is used.
 
 NativeMethod nativeMethods[] = {
-	// base/framework/System_gc_()V
-	{ 320166981UL, FCSystem_gc },
-	// base/framework/System_print_(Ljava/lang/String;)V
-	{ 320167194UL, FCSystem_print },
-	// base/framework/System_newInstance_(Ljava/lang/String;)Ljava/lang/Object;
-	{ 320175153UL, FCSystem_newInstance },
-	// base/framework/System_getClassName_(Ljava/lang/Object;)Ljava/lang/String;
-	{ 320178738UL, FCSystem_getClassName },
-	// base/framework/System_arraycopy_(Ljava/lang/Object;ILjava/lang/Object;II)V
-	{ 320182067UL, FCSystem_arrayCopy },
-	// base/framework/System_hasClass_(Ljava/lang/String;)Z
-	{ 320184157UL, FCSystem_hasClass },
-	// base/framework/System_printStackTrace_()V
-	{ 320187986UL, FCSystem_printStackTrace },
-	// base/framework/System_getInput_(I)[Ljava/lang/String;
-	{ 320190814UL, FCSystem_getInput },
-	// base/framework/System_sleep_(I)I
-	{ 320192265UL, FCSystem_sleep },
-	// base/framework/System_setOutput_([Ljava/lang/String;)V
-	{ 320200671UL, FCSystem_setOutput },
-
-	// base/framework/Convert_toInt_(Ljava/lang/String;)I
-	{ 706105882UL, Convert_StringToInt },
-	// base/framework/Convert_toString_(C)Ljava/lang/String;
-	{ 706126749UL, Convert_CharToString },
-	// base/framework/Convert_toString_(I)Ljava/lang/String;
-	{ 706127133UL, Convert_IntToString },
-	// base/framework/Convert_toString_(Z)Ljava/lang/String;
-	{ 706128221UL, Convert_BooleanToString },
-
-	// base/framework/Util_byteArrayCopy_([BI[BII)V
-	{ 3646096023UL, Util_byteArrayCopy },
-	// base/framework/Util_byteArrayCompare_([BI[BII)I
-	{ 3646114394UL, Util_byteArrayCompare },
-	// base/framework/Util_byteArrayFill_([BIIB)V
-	{ 3646149781UL, Util_byteArrayFill },
+	{ "base/framework/System", "printHeapHistogram", "()V", FCSystem_printHeapHistogram },
+	{ "base/framework/System", "gc", "()V", FCSystem_gc },
+	{ "base/framework/System", "print", "(Ljava/lang/String;)V", FCSystem_print },
+	{ "base/framework/System", "getGcTotals", "([I)I", FCSystem_getGcTotals },
+	{ "base/framework/System", "newInstance", "(Ljava/lang/String;)Ljava/lang/Object;", FCSystem_newInstance },
+	{ "base/framework/System", "getGcHistory", "([I)I", FCSystem_getGcHistory },
+	{ "base/framework/System", "getClassName", "(Ljava/lang/Object;)Ljava/lang/String;", FCSystem_getClassName },
+	{ "base/framework/System", "arraycopy", "(Ljava/lang/Object;ILjava/lang/Object;II)V", FCSystem_arrayCopy, NATIVE_LEAF },
+	{ "base/framework/System", "hasClass", "(Ljava/lang/String;)Z", FCSystem_hasClass },
+	{ "base/framework/System", "dumpHeap", "()Z", FCSystem_dumpHeap },
+	{ "base/framework/System", "printStackTrace", "()V", FCSystem_printStackTrace },
+	{ "base/framework/System", "getInput", "(I)[Ljava/lang/String;", FCSystem_getInput },
+	{ "base/framework/System", "sleep", "(I)I", FCSystem_sleep },
+	{ "base/framework/System", "setOutput", "([Ljava/lang/String;)V", FCSystem_setOutput },
+	{ "base/framework/System", "getInputSize", "()I", FCSystem_getInputSize, NATIVE_LEAF },
+	{ "base/framework/System", "readInput", "(I[BII)I", FCSystem_readInput, NATIVE_LEAF },
+	{ "base/framework/System", "writeOutput", "([BII)I", FCSystem_writeOutput, NATIVE_LEAF },
+	{ "base/framework/System", "readStream", "([BII)I", FCSystem_readStream, NATIVE_LEAF },
+	{ "base/framework/System", "writeStream", "([BII)I", FCSystem_writeStream, NATIVE_LEAF },
+	{ "base/framework/System", "flushStream", "()V", FCSystem_flushStream, NATIVE_LEAF },
+
+	{ "java/lang/StringBuffer", "append", "(C)Ljava/lang/StringBuffer;", StringBuilder_appendChar },
+	{ "java/lang/StringBuffer", "append", "(D)Ljava/lang/StringBuffer;", StringBuilder_appendDouble },
+	{ "java/lang/StringBuffer", "append", "(F)Ljava/lang/StringBuffer;", StringBuilder_appendFloat },
+	{ "java/lang/StringBuffer", "append", "(I)Ljava/lang/StringBuffer;", StringBuilder_appendInt },
+	{ "java/lang/StringBuffer", "append", "(J)Ljava/lang/StringBuffer;", StringBuilder_appendLong },
+	{ "java/lang/StringBuffer", "append", "(Z)Ljava/lang/StringBuffer;", StringBuilder_appendBoolean },
+	{ "java/lang/StringBuffer", "toString", "()Ljava/lang/String;", StringBuilder_toString },
+	{ "java/lang/StringBuffer", "append", "(Ljava/lang/String;)Ljava/lang/StringBuffer;", StringBuilder_appendString },
+
+	{ "base/framework/Convert", "toInt", "(Ljava/lang/String;)I", Convert_StringToInt, NATIVE_LEAF },
+	{ "base/framework/Convert", "toString", "(C)Ljava/lang/String;", Convert_CharToString },
+	{ "base/framework/Convert", "toString", "(D)Ljava/lang/String;", Convert_DoubleToString },
+	{ "base/framework/Convert", "toString", "(F)Ljava/lang/String;", Convert_FloatToString },
+	{ "base/framework/Convert", "toString", "(I)Ljava/lang/String;", Convert_IntToString },
+	{ "base/framework/Convert", "toString", "(J)Ljava/lang/String;", Convert_LongToString },
+	{ "base/framework/Convert", "toString", "(Z)Ljava/lang/String;", Convert_BooleanToString },
+
+	{ "java/lang/StringBuilder", "append", "(C)Ljava/lang/StringBuilder;", StringBuilder_appendChar },
+	{ "java/lang/StringBuilder", "append", "(D)Ljava/lang/StringBuilder;", StringBuilder_appendDouble },
+	{ "java/lang/StringBuilder", "append", "(F)Ljava/lang/StringBuilder;", StringBuilder_appendFloat },
+	{ "java/lang/StringBuilder", "append", "(I)Ljava/lang/StringBuilder;", StringBuilder_appendInt },
+	{ "java/lang/StringBuilder", "append", "(J)Ljava/lang/StringBuilder;", StringBuilder_appendLong },
+	{ "java/lang/StringBuilder", "append", "(Z)Ljava/lang/StringBuilder;", StringBuilder_appendBoolean },
+	{ "java/lang/StringBuilder", "toString", "()Ljava/lang/String;", StringBuilder_toString },
+	{ "java/lang/StringBuilder", "append", "(Ljava/lang/String;)Ljava/lang/StringBuilder;", StringBuilder_appendString },
+
+	{ "base/framework/Util", "byteArrayCopy", "([BI[BII)V", Util_byteArrayCopy, NATIVE_LEAF },
+	{ "base/framework/Util", "byteArrayCompare", "([BI[BII)I", Util_byteArrayCompare, NATIVE_LEAF },
+	{ "base/framework/Util", "byteArrayFill", "([BIIB)V", Util_byteArrayFill, NATIVE_LEAF },
 };
 
 int NumberOfNativeMethods = sizeof(nativeMethods) / sizeof(NativeMethod);
 
+//
+// Native Method Registry
+//
+
+// The registry is a hash table keyed by the full class name, method name
+// and descriptor so two methods can never be mixed up. It lives in static
+// memory, not the memory of mem_alloc(), since it outlives VmFree() and
+// mem_dispose(): the natives a host registers stay for the next run.
+typedef struct {
+	NativeMethod method;
+	short next; // next entry in the hash chain or -1
+} NativeEntry;
+
+static NativeEntry nativeEntries[MAX_NATIVE_METHODS];
+static short nativeHashList[NATIVE_HASH_SIZE];
+static unsigned short numNativeEntries = 0;
+static int nativeRegistryReady = 0;
+
+// FNV-1a, the strings are separated so "ab"+"c" differs from "a"+"bc"
+static unsigned long hashNativeString(unsigned long hash, const char *str, unsigned long len) {
+	unsigned long i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 16777619UL;
+	}
+	hash ^= 0xFF; // not a byte of a class file name
+	hash *= 16777619UL;
+	return hash & 0xFFFFFFFFUL;
+}
+
+static unsigned long hashNativeMethod(UtfString className, UtfString name, UtfString desc) {
+	unsigned long hash;
+
+	hash = 2166136261UL;
+	hash = hashNativeString(hash, className.str, className.len);
+	hash = hashNativeString(hash, name.str, name.len);
+	hash = hashNativeString(hash, desc.str, desc.len);
+	return hash % NATIVE_HASH_SIZE;
+}
+
+static int matchNativeString(const char *s, UtfString utf) {
+	return strncmp(s, utf.str, utf.len) == 0 && s[utf.len] == '\0';
+}
+
+static NativeEntry *findNativeEntry(UtfString className, UtfString name, UtfString desc, unsigned long hash) {
+	NativeEntry *entry;
+	short i;
+
+	for (i = nativeHashList[hash]; i >= 0; i = entry->next) {
+		entry = &nativeEntries[i];
+		if (matchNativeString(entry->method.name, name) &&
+			matchNativeString(entry->method.desc, desc) &&
+			matchNativeString(entry->method.className, className))
+			return entry;
+	}
+	return NULL;
+}
+
+static long addNative(const NativeMethod *method) {
+	NativeEntry *entry;
+	UtfString className, name, desc;
+	unsigned long hash;
+
+	if (method->className == NULL || method->name == NULL || method->desc == NULL || method->func == NULL)
+		return FT_ERR_INVALID_PARAM;
+	className = createUtfString(method->className);
+	name = createUtfString(method->name);
+	desc = createUtfString(method->desc);
+	hash = hashNativeMethod(className, name, desc);
+
+	entry = findNativeEntry(className, name, desc, hash);
+	if (entry != NULL) {
+		entry->method.func = method->func;
+		entry->method.flags = method->flags;
+		return FT_ERR_OK;
+	}
+	if (numNativeEntries >= MAX_NATIVE_METHODS)
+		return FT_ERR_NOTENOUGH;
+	entry = &nativeEntries[numNativeEntries];
+	entry->method = *method;
+	entry->next = nativeHashList[hash];
+	nativeHashList[hash] = (short)numNativeEntries++;
+	return FT_ERR_OK;
+}
+
+// put the natives of the class library in first so a host can replace them
+static void initNativeRegistry(void) {
+	unsigned long i;
+
+	if (nativeRegistryReady)
+		return;
+	nativeRegistryReady = 1;
+	for (i = 0; i < NATIVE_HASH_SIZE; i++)
+		nativeHashList[i] = -1;
+	for (i = 0; i < (unsigned long)NumberOfNativeMethods; i++)
+		addNative(&nativeMethods[i]);
+}
+
+long VmRegisterNative(const char *className, const char *name, const char *desc, NativeFunc func, unsigned short flags) {
+	NativeMethod method;
+
+	initNativeRegistry();
+	method.className = className;
+	method.name = name;
+	method.desc = desc;
+	method.func = func;
+	method.flags = flags;
+	return addNative(&method);
+}
+
+long VmRegisterNatives(const NativeMethod *methods, unsigned long numMethods) {
+	unsigned long i;
+	long ret;
+
+	initNativeRegistry();
+	for (i = 0; i < numMethods; i++) {
+		ret = addNative(&methods[i]);
+		if (ret != FT_ERR_OK)
+			return ret;
+	}
+	return FT_ERR_OK;
+}
+
+const NativeMethod *findNativeMethod(UtfString className, UtfString name, UtfString desc) {
+	NativeEntry *entry;
+
+	initNativeRegistry();
+	entry = findNativeEntry(className, name, desc, hashNativeMethod(className, name, desc));
+	if (entry == NULL)
+		return NULL;
+	return &entry->method;
+}
+
 unsigned char *nativeLoadClass(UtfString className ){
 	char path[128];
 
+	if( className.len >= sizeof(path) )
+		return NULL;
 	strncpy( path, className.str, className.len );
 	path[ className.len ] = '\0';
 	return getClassCode( path );
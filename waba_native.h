@@ -10,6 +10,8 @@ extern "C" {
 extern NativeMethod nativeMethods[];
 extern int NumberOfNativeMethods;
 
+const NativeMethod *findNativeMethod(UtfString className, UtfString name, UtfString desc);
+
 unsigned char *nativeLoadClass( UtfString className );
 
 #ifdef __cplusplus
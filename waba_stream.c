@@ -0,0 +1,122 @@
+#include "waba.h"
+#include "waba_stream.h"
+#include <string.h>
+
+//
+// Input and Output Streams
+//
+
+// The input and output streams are ring buffers of STREAM_BUFFER_SIZE
+// bytes between the host and Java. The host pushes input and pulls
+// output with the VmStream functions, also while the VM is running:
+// when Java reads from an empty input or writes to a full output, the
+// hook is called so the host can refill or drain the buffer right away.
+// Without a hook (or if it doesn't help) a read returns 0 and a write
+// returns the bytes that fit, so Java can go on and try again later.
+//
+// The buffers are static, they must keep the input the host pushed
+// before the VM starts and the output left after it is freed.
+
+typedef struct {
+	unsigned char buffer[STREAM_BUFFER_SIZE];
+	unsigned long head; // next byte to read
+	unsigned long count; // bytes in the buffer
+	unsigned char closed; // no more bytes will be pushed
+} StreamRing;
+
+static StreamRing inStream;
+static StreamRing outStream;
+static StreamHook streamHook = NULL;
+
+static unsigned long ringPut(StreamRing *ring, const unsigned char *data, unsigned long len) {
+	unsigned long tail, n;
+
+	if (len > STREAM_BUFFER_SIZE - ring->count)
+		len = STREAM_BUFFER_SIZE - ring->count;
+	tail = (ring->head + ring->count) % STREAM_BUFFER_SIZE;
+	n = STREAM_BUFFER_SIZE - tail;
+	if (n > len)
+		n = len;
+	memcpy(&ring->buffer[tail], data, n);
+	memcpy(ring->buffer, data + n, len - n);
+	ring->count += len;
+	return len;
+}
+
+static unsigned long ringGet(StreamRing *ring, unsigned char *data, unsigned long len) {
+	unsigned long n;
+
+	if (len > ring->count)
+		len = ring->count;
+	n = STREAM_BUFFER_SIZE - ring->head;
+	if (n > len)
+		n = len;
+	memcpy(data, &ring->buffer[ring->head], n);
+	memcpy(data + n, ring->buffer, len - n);
+	ring->head = (ring->head + len) % STREAM_BUFFER_SIZE;
+	ring->count -= len;
+	return len;
+}
+
+// empty both streams and open the input again
+void VmStreamReset(void) {
+	inStream.head = inStream.count = 0;
+	inStream.closed = 0;
+	outStream.head = outStream.count = 0;
+	outStream.closed = 0;
+}
+
+void VmStreamSetHook(StreamHook hook) {
+	streamHook = hook;
+}
+
+// add input for Java, returns the bytes that fit
+unsigned long VmStreamPush(const unsigned char *data, unsigned long len) {
+	if (inStream.closed)
+		return 0;
+	return ringPut(&inStream, data, len);
+}
+
+// the input ends when Java has read what is in the buffer
+void VmStreamCloseInput(void) {
+	inStream.closed = 1;
+}
+
+// take up to len bytes of the output Java wrote
+unsigned long VmStreamPull(unsigned char *data, unsigned long len) {
+	return ringGet(&outStream, data, len);
+}
+
+// read up to len bytes of input, returns their number, 0 if there is
+// nothing yet or -1 at the end of the input
+long streamRead(unsigned char *data, unsigned long len) {
+	if (len == 0)
+		return 0;
+	if (inStream.count == 0 && !inStream.closed && streamHook != NULL)
+		streamHook(STREAM_NEED_INPUT);
+	if (inStream.count == 0)
+		return inStream.closed ? -1 : 0;
+	return (long)ringGet(&inStream, data, len);
+}
+
+// write up to len bytes of output, returns the bytes written which are
+// less than len when the output is full and the host doesn't pull it
+unsigned long streamWrite(const unsigned char *data, unsigned long len) {
+	unsigned long done, n;
+
+	done = ringPut(&outStream, data, len);
+	while (done < len && streamHook != NULL) {
+		streamHook(STREAM_HAS_OUTPUT);
+		n = ringPut(&outStream, data + done, len - done);
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+// give the host the output written so far
+void streamFlush(void) {
+	if (outStream.count != 0 && streamHook != NULL)
+		streamHook(STREAM_HAS_OUTPUT);
+}
@@ -0,0 +1,32 @@
+#ifndef _WABA_STREAM_H_
+#define _WABA_STREAM_H_
+
+#include "waba.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+// events passed to the stream hook
+#define STREAM_NEED_INPUT	0 // Java reads and the input is empty
+#define STREAM_HAS_OUTPUT	1 // Java writes and the output is full, or flushes
+
+// called from inside the VM so the host can push input or pull output.
+// It must not call back into the VM other than the VmStream functions.
+typedef void (*StreamHook)(unsigned long event);
+
+void VmStreamReset(void);
+void VmStreamSetHook(StreamHook hook);
+unsigned long VmStreamPush(const unsigned char *data, unsigned long len);
+void VmStreamCloseInput(void);
+unsigned long VmStreamPull(unsigned char *data, unsigned long len);
+
+long streamRead(unsigned char *data, unsigned long len);
+unsigned long streamWrite(const unsigned char *data, unsigned long len);
+void streamFlush(void);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif
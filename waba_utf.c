@@ -2,6 +2,11 @@
 #include "utils.h"
 #include "waba_utf.h"
 #include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 //
 // UtfString Routines
@@ -36,31 +41,416 @@ UtfString getUtfString(WClass *wclass, unsigned short idx) {
 	return s;
 }
 
-WObject createStringFromUtf(UtfString s) {
-	WObject obj, charArrayObj;
-	unsigned short *charStart;
-	unsigned long i;
+// create a String object around the given byte array
+WObject createStringFromValue(WObject value, unsigned char coder) {
+	WObject obj;
 
-	// create and fill char array
-	charArrayObj = createArrayObject(TYPE_CHAR, s.len);
-	if (charArrayObj == WOBJECT_NULL)
+	if (pushObject(value) != FT_ERR_OK)
 		return WOBJECT_NULL;
-	if (pushObject(charArrayObj) != FT_ERR_OK)
-		return WOBJECT_NULL;
-	charStart = (unsigned short *)WOBJ_arrayStart(charArrayObj);
-	for (i = 0; i < s.len; i++)
-		charStart[i] =(unsigned short)s.str[i];
-	// create String object and set char array
 	obj = createObject(stringClass);
-	if( obj == WOBJECT_NULL ){
-		popObject();
+	popObject(); // value
+	if (obj == WOBJECT_NULL)
 		return WOBJECT_NULL;
-	}
-	WOBJ_StringCharArrayObj(obj) = charArrayObj;
-	popObject(); // charArrayObj
+	WOBJ_StringValueObj(obj) = value;
+	WOBJ_StringCoder(obj) = coder;
 	return obj;
 }
 
+//
+// UTF-8 Transcoding
+//
+
+// Strings cross the native boundary as UTF-8 (class constants are Java's
+// modified UTF-8 which decodes the same way). Most text is ASCII so the
+// ASCII runs are found and copied a vector at a time when the compiler
+// targets SSE2 or AVX2, the rest is decoded one character at a time.
+
+#define UTF_REPLACEMENT_CHAR 0xFFFD
+
+// returns the length of the run of ASCII bytes at the start of s
+static unsigned long asciiPrefix(const unsigned char *s, unsigned long len) {
+	unsigned long i;
+
+	i = 0;
+#if defined(__AVX2__)
+	for (; i + 32 <= len; i += 32) {
+		if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)&s[i])) != 0)
+			break;
+	}
+#elif defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)&s[i])) != 0)
+			break;
+	}
+#endif
+	while (i < len && s[i] < 0x80)
+		i++;
+	return i;
+}
+
+// decode the character at s[*pos] and move *pos past it. Bad sequences
+// decode to U+FFFD one byte at a time.
+static unsigned long decodeUtf8(const unsigned char *s, unsigned long len, unsigned long *pos) {
+	unsigned long i, c, n, min;
+
+	i = *pos;
+	c = s[i++];
+	if (c < 0x80)
+		n = 0, min = 0;
+	else if ((c & 0xE0) == 0xC0)
+		n = 1, min = 0x80, c &= 0x1F;
+	else if ((c & 0xF0) == 0xE0)
+		n = 2, min = 0x800, c &= 0x0F;
+	else if ((c & 0xF8) == 0xF0)
+		n = 3, min = 0x10000, c &= 0x07;
+	else {
+		*pos = i;
+		return UTF_REPLACEMENT_CHAR;
+	}
+	if (i + n > len) {
+		*pos = i;
+		return UTF_REPLACEMENT_CHAR;
+	}
+	for (; n > 0; n--, i++) {
+		if ((s[i] & 0xC0) != 0x80) {
+			*pos = *pos + 1;
+			return UTF_REPLACEMENT_CHAR;
+		}
+		c = (c << 6) | (s[i] & 0x3F);
+	}
+	// modified UTF-8 writes NUL as two bytes, anything else too long is bad
+	if ((c < min && !(c == 0 && min == 0x80)) || c > 0x10FFFF) {
+		*pos = *pos + 1;
+		return UTF_REPLACEMENT_CHAR;
+	}
+	*pos = i;
+	return c;
+}
+
+WObject createStringFromUtf(UtfString s) {
+	WObject value;
+	const unsigned char *src;
+	unsigned char *bytes, coder;
+	unsigned long i, j, c, len, ascii;
+
+	src = (const unsigned char *)s.str;
+	ascii = asciiPrefix(src, s.len);
+
+	// count the characters and see if they all fit in Latin-1
+	len = ascii;
+	coder = STRING_LATIN1;
+#if !COMPACT_STRINGS
+	coder = STRING_UTF16;
+#endif
+	for (i = ascii; i < s.len; ) {
+		c = decodeUtf8(src, s.len, &i);
+		if (c > 0xFF)
+			coder = STRING_UTF16;
+		len += (c > 0xFFFF) ? 2 : 1;
+	}
+
+	value = createArrayObject(TYPE_BYTE, len << coder);
+	if (value == WOBJECT_NULL)
+		return WOBJECT_NULL;
+	bytes = (unsigned char *)WOBJ_arrayStart(value);
+	if (coder == STRING_LATIN1) {
+		memcpy(bytes, src, ascii);
+		for (i = j = ascii; i < s.len; )
+			bytes[j++] = (unsigned char)decodeUtf8(src, s.len, &i);
+	}
+	else {
+		for (i = 0; i < ascii; i++) {
+			bytes[i * 2] = src[i];
+			bytes[i * 2 + 1] = 0;
+		}
+		for (j = ascii * 2; i < s.len; ) {
+			c = decodeUtf8(src, s.len, &i);
+			if (c > 0xFFFF) {
+				// surrogate pair
+				c -= 0x10000;
+				bytes[j++] = (unsigned char)(0xD800 + (c >> 10));
+				bytes[j++] = (unsigned char)((0xD800 + (c >> 10)) >> 8);
+				c = 0xDC00 + (c & 0x3FF);
+			}
+			bytes[j++] = (unsigned char)c;
+			bytes[j++] = (unsigned char)(c >> 8);
+		}
+	}
+	return createStringFromValue(value, coder);
+}
+
+WObject createStringFromChars(const unsigned short *chars, unsigned long len) {
+	WObject value;
+	unsigned char *bytes, coder;
+	unsigned long i;
+
+	coder = STRING_UTF16;
+#if COMPACT_STRINGS
+	for (i = 0; i < len && chars[i] <= 0xFF; i++)
+		;
+	if (i == len)
+		coder = STRING_LATIN1;
+#endif
+	value = createArrayObject(TYPE_BYTE, len << coder);
+	if (value == WOBJECT_NULL)
+		return WOBJECT_NULL;
+	bytes = (unsigned char *)WOBJ_arrayStart(value);
+	for (i = 0; i < len; i++) {
+		if (coder == STRING_LATIN1)
+			bytes[i] = (unsigned char)chars[i];
+		else {
+			bytes[i * 2] = (unsigned char)chars[i];
+			bytes[i * 2 + 1] = (unsigned char)(chars[i] >> 8);
+		}
+	}
+	return createStringFromValue(value, coder);
+}
+
+// returns the number of characters in a string or -1 if it has no value
+long getStringLength(WObject string) {
+	WObject value;
+
+	value = WOBJ_StringValueObj(string);
+	if (value == WOBJECT_NULL)
+		return -1;
+	return WOBJ_arrayLen(value) >> WOBJ_StringCoder(string);
+}
+
+unsigned short getStringChar(WObject string, long i) {
+	unsigned char *bytes;
+
+	bytes = (unsigned char *)WOBJ_arrayStart(WOBJ_StringValueObj(string));
+	if (WOBJ_StringCoder(string) == STRING_LATIN1)
+		return bytes[i];
+	return (unsigned short)(bytes[i * 2] | (bytes[i * 2 + 1] << 8));
+}
+
+// returns the length of the run of UTF16 characters below 0x80 at the
+// start of chars (len characters, two bytes each, low byte first)
+static unsigned long asciiPrefix16(const unsigned char *chars, unsigned long len) {
+	unsigned long i;
+
+	i = 0;
+#if defined(__SSE2__)
+	{
+		const __m128i mask = _mm_set1_epi16((short)0xFF80);
+		const __m128i zero = _mm_setzero_si128();
+
+		for (; i + 8 <= len; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *)&chars[i * 2]);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, mask), zero)) != 0xFFFF)
+				break;
+		}
+	}
+#endif
+	while (i < len && chars[i * 2 + 1] == 0 && chars[i * 2] < 0x80)
+		i++;
+	return i;
+}
+
+// write c as UTF-8 to buf (if buf is not NULL), returns the number of bytes
+static unsigned long encodeUtf8(unsigned long c, unsigned char *buf) {
+	if (c < 0x80) {
+		if (buf != NULL)
+			buf[0] = (unsigned char)c;
+		return 1;
+	}
+	if (c < 0x800) {
+		if (buf != NULL) {
+			buf[0] = (unsigned char)(0xC0 | (c >> 6));
+			buf[1] = (unsigned char)(0x80 | (c & 0x3F));
+		}
+		return 2;
+	}
+	if (c < 0x10000) {
+		if (buf != NULL) {
+			buf[0] = (unsigned char)(0xE0 | (c >> 12));
+			buf[1] = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+			buf[2] = (unsigned char)(0x80 | (c & 0x3F));
+		}
+		return 3;
+	}
+	if (buf != NULL) {
+		buf[0] = (unsigned char)(0xF0 | (c >> 18));
+		buf[1] = (unsigned char)(0x80 | ((c >> 12) & 0x3F));
+		buf[2] = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+		buf[3] = (unsigned char)(0x80 | (c & 0x3F));
+	}
+	return 4;
+}
+
+// encode the characters of a string as UTF-8 into buf, or only count
+// the bytes if buf is NULL. Unpaired surrogates become U+FFFD.
+static unsigned long encodeString(WObject string, unsigned char *buf) {
+	WObject value;
+	unsigned char *bytes;
+	unsigned long i, n, c, d, len, ascii;
+
+	value = WOBJ_StringValueObj(string);
+	bytes = (unsigned char *)WOBJ_arrayStart(value);
+	len = WOBJ_arrayLen(value);
+	n = 0;
+	if (WOBJ_StringCoder(string) == STRING_LATIN1) {
+		ascii = asciiPrefix(bytes, len);
+		if (buf != NULL)
+			memcpy(buf, bytes, ascii);
+		n = ascii;
+		for (i = ascii; i < len; i++)
+			n += encodeUtf8(bytes[i], buf != NULL ? &buf[n] : NULL);
+		return n;
+	}
+
+	len /= 2;
+	ascii = asciiPrefix16(bytes, len);
+	if (buf != NULL) {
+		i = 0;
+#if defined(__SSE2__)
+		for (; i + 8 <= ascii; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *)&bytes[i * 2]);
+			_mm_storel_epi64((__m128i *)&buf[i], _mm_packus_epi16(v, v));
+		}
+#endif
+		for (; i < ascii; i++)
+			buf[i] = bytes[i * 2];
+	}
+	n = ascii;
+	for (i = ascii; i < len; i++) {
+		c = bytes[i * 2] | (bytes[i * 2 + 1] << 8);
+		if (c >= 0xD800 && c <= 0xDFFF) {
+			d = (i + 1 < len) ? (unsigned long)(bytes[i * 2 + 2] | (bytes[i * 2 + 3] << 8)) : 0;
+			if (c <= 0xDBFF && d >= 0xDC00 && d <= 0xDFFF) {
+				c = 0x10000 + ((c - 0xD800) << 10) + (d - 0xDC00);
+				i++;
+			}
+			else
+				c = UTF_REPLACEMENT_CHAR;
+		}
+		n += encodeUtf8(c, buf != NULL ? &buf[n] : NULL);
+	}
+	return n;
+}
+
+// returns the number of bytes the UTF-8 form of a string takes or -1 if
+// the string has no value
+long getStringUtfLength(WObject string) {
+	if (WOBJ_StringValueObj(string) == WOBJECT_NULL)
+		return -1;
+	return (long)encodeString(string, NULL);
+}
+
+// write the UTF-8 form of a string to buf which must hold
+// getStringUtfLength() bytes
+void getStringUtf(WObject string, unsigned char *buf) {
+	encodeString(string, buf);
+}
+
+//
+// StringWriter
+//
+
+// A StringWriter makes one String out of several pieces in two passes.
+// The first pass (bytes is NULL) only measures the length and the coder,
+// beginStringWrite() then allocates the value and the second pass writes
+// the same pieces into it. Nothing may be allocated during the second pass.
+
+void initStringWriter(StringWriter *w) {
+	w->value = WOBJECT_NULL;
+	w->bytes = NULL;
+	w->len = 0;
+#if COMPACT_STRINGS
+	w->coder = STRING_LATIN1;
+#else
+	w->coder = STRING_UTF16;
+#endif
+}
+
+int beginStringWrite(StringWriter *w) {
+	w->value = createArrayObject(TYPE_BYTE, w->len << w->coder);
+	if (w->value == WOBJECT_NULL)
+		return FT_ERR_NOTENOUGH;
+	w->bytes = (unsigned char *)WOBJ_arrayStart(w->value);
+	w->len = 0;
+	return FT_ERR_OK;
+}
+
+WObject endStringWrite(StringWriter *w) {
+	return createStringFromValue(w->value, w->coder);
+}
+
+static void putChar(StringWriter *w, unsigned long c) {
+	if (w->bytes == NULL) {
+		if (c > 0xFF)
+			w->coder = STRING_UTF16;
+	}
+	else if (w->coder == STRING_LATIN1)
+		w->bytes[w->len] = (unsigned char)c;
+	else {
+		w->bytes[w->len * 2] = (unsigned char)c;
+		w->bytes[w->len * 2 + 1] = (unsigned char)(c >> 8);
+	}
+	w->len++;
+}
+
+// write len Latin-1 bytes from src (bytes or chars of a LATIN1 value)
+static void putLatin1(StringWriter *w, const unsigned char *src, unsigned long len) {
+	unsigned long i;
+
+	if (w->bytes != NULL) {
+		if (w->coder == STRING_LATIN1)
+			memcpy(&w->bytes[w->len], src, len);
+		else {
+			for (i = 0; i < len; i++) {
+				w->bytes[(w->len + i) * 2] = src[i];
+				w->bytes[(w->len + i) * 2 + 1] = 0;
+			}
+		}
+	}
+	w->len += len;
+}
+
+void writeChar(StringWriter *w, unsigned short c) {
+	putChar(w, c);
+}
+
+void writeUtf(StringWriter *w, const char *s, unsigned long len) {
+	const unsigned char *src;
+	unsigned long i, c, ascii;
+
+	src = (const unsigned char *)s;
+	ascii = asciiPrefix(src, len);
+	putLatin1(w, src, ascii);
+	for (i = ascii; i < len; ) {
+		c = decodeUtf8(src, len, &i);
+		if (c > 0xFFFF) {
+			c -= 0x10000;
+			putChar(w, 0xD800 + (c >> 10));
+			c = 0xDC00 + (c & 0x3FF);
+		}
+		putChar(w, c);
+	}
+}
+
+void writeString(StringWriter *w, WObject string) {
+	WObject value;
+	unsigned char coder;
+	unsigned long len;
+
+	value = WOBJ_StringValueObj(string);
+	if (value == WOBJECT_NULL)
+		return;
+	coder = WOBJ_StringCoder(string);
+	len = WOBJ_arrayLen(value) >> coder;
+	if (coder == STRING_LATIN1) {
+		putLatin1(w, (unsigned char *)WOBJ_arrayStart(value), len);
+		return;
+	}
+	if (w->bytes == NULL)
+		w->coder = STRING_UTF16;
+	else
+		memcpy(&w->bytes[w->len * 2], WOBJ_arrayStart(value), len * 2);
+	w->len += len;
+}
+
 #define STU_STATIC_SIZE		256
 static unsigned char sbytes[STU_STATIC_SIZE];
 
@@ -78,9 +468,8 @@ unsigned char* UtfToStaticUChars(UtfString str) {
 // combination of the STU constants.
 UtfString stringToUtf(WObject string, int flags) {
 	UtfString s, e;
-	WObject charArray;
-	unsigned long i, extra;
-	unsigned short *chars, len;
+	long len;
+	unsigned long extra;
 	unsigned char *bytes;
 	int nullTerminate, useStatic;
 
@@ -88,10 +477,9 @@ UtfString stringToUtf(WObject string, int flags) {
 	e.str = NULL;
 	if (string == WOBJECT_NULL)
 		return e;
-	charArray = WOBJ_StringCharArrayObj(string);
-	if (charArray == WOBJECT_NULL)
+	len = getStringUtfLength(string);
+	if (len < 0 || len > 0xFFFF)
 		return e;
-	len = (unsigned short)WOBJ_arrayLen(charArray);
 	nullTerminate = flags & STU_NULL_TERMINATE;
 	useStatic = flags & STU_USE_STATIC;
 	extra = 0;
@@ -107,13 +495,11 @@ UtfString stringToUtf(WObject string, int flags) {
 			return e;
 		bytes = (unsigned char *)WOBJ_arrayStart(byteArray);
 	}
-	chars = (unsigned short *)WOBJ_arrayStart(charArray);
-	for (i = 0; i < len; i++)
-		bytes[i] = (unsigned char)chars[i];
+	getStringUtf(string, bytes);
 	if (nullTerminate)
-		bytes[i] = '\0';
+		bytes[len] = '\0';
 	s.str = (char *)bytes;
-	s.len = len;
+	s.len = (unsigned short)len;
 	return s;
 }
 
@@ -13,12 +13,32 @@ extern "C" {
 
 extern WClass *stringClass;
 
+// see initStringWriter()
+typedef struct {
+	WObject value;
+	unsigned char *bytes; // NULL while measuring
+	unsigned long len; // in characters
+	unsigned char coder;
+} StringWriter;
+
 UtfString createUtfString(const char *buf);
 UtfString getUtfString(WClass *wclass, unsigned short idx);
 WObject createStringFromUtf(UtfString s);
+WObject createStringFromValue(WObject value, unsigned char coder);
+WObject createStringFromChars(const unsigned short *chars, unsigned long len);
+long getStringLength(WObject string);
+unsigned short getStringChar(WObject string, long i);
+long getStringUtfLength(WObject string);
+void getStringUtf(WObject string, unsigned char *buf);
 UtfString stringToUtf(WObject string, int flags);
 WObject createString(const char *buf);
 unsigned char* UtfToStaticUChars(UtfString str);
+void initStringWriter(StringWriter *w);
+int beginStringWrite(StringWriter *w);
+WObject endStringWrite(StringWriter *w);
+void writeUtf(StringWriter *w, const char *s, unsigned long len);
+void writeChar(StringWriter *w, unsigned short c);
+void writeString(StringWriter *w, WObject string);
 
 #ifdef __cplusplus
 }
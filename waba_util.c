@@ -2,6 +2,8 @@
 #include "waba.h"
 #include "waba_utf.h"
 #include "waba_util.h"
+#include "waba_heap.h"
+#include "waba_stream.h"
 
 long callStaticMethod(WClass* wclass, UtfString name, UtfString desc, Var params[], unsigned short numParams, unsigned char *retType, Var* retVar){
 	WClassMethod* staticMethod;
@@ -14,16 +16,11 @@ long callStaticMethod(WClass* wclass, UtfString name, UtfString desc, Var params
 	return executeMethod(vclass, staticMethod, params, numParams, retType, retVar);
 }
 
-long startStaticMain(const char *className, const char *param, unsigned char *retType, Var* retVar) {
+static long callMain(WClass *wclass, WClassMethod *mainMethod, const char *param, unsigned char *retType, Var* retVar) {
 	long ret;
-	WClass *wclass;
 	Var params[1];
 	WObject* strArray;
 
-	wclass = getClass(createUtfString(className));
-	if (wclass == NULL)
-		return FT_ERR_NOTFOUND;
-
 	params[0].obj = createArrayObject(TYPE_OBJECT, 1);
 	if (pushObject(params[0].obj) != FT_ERR_OK)
 		return FT_ERR_UNKNOWN;
@@ -35,7 +32,7 @@ long startStaticMain(const char *className, const char *param, unsigned char *re
 		return FT_ERR_UNKNOWN;
 	}
 
-	ret = callStaticMethod(wclass, createUtfString("main"), createUtfString("([Ljava/lang/String;)V"), params, 1, retType, retVar);
+	ret = executeMethod(wclass, mainMethod, params, 1, retType, retVar);
 
 	popObject();
 	popObject();
@@ -43,3 +40,63 @@ long startStaticMain(const char *className, const char *param, unsigned char *re
 	return ret;
 }
 
+static WClassMethod *getMainMethod(const char *className, WClass **vclass) {
+	WClass *wclass;
+
+	wclass = getClass(createUtfString(className));
+	if (wclass == NULL)
+		return NULL;
+	return getMethod(wclass, createUtfString("main"), createUtfString("([Ljava/lang/String;)V"), vclass);
+}
+
+long startStaticMain(const char *className, const char *param, unsigned char *retType, Var* retVar) {
+	WClassMethod *mainMethod;
+	WClass *vclass;
+
+	mainMethod = getMainMethod(className, &vclass);
+	if (mainMethod == NULL)
+		return FT_ERR_NOTFOUND;
+
+	return callMain(vclass, mainMethod, param, retType, retVar);
+}
+
+// run main once for each of the params in the same VM, so the classes
+// are loaded and initialized only once. The objects of a record are
+// collected and the streams are emptied before the next one starts, the
+// static fields are kept.
+long startStaticMainBatch(const char *className, const char *params[], unsigned long numParams, long status[], BatchHook hook, void *arg) {
+	WClassMethod *mainMethod;
+	WClass *vclass;
+	Var retVar;
+	unsigned char retType;
+	unsigned long i;
+	long ret;
+
+	for (i = 0; i < numParams; i++)
+		status[i] = BATCH_FAILED;
+
+	mainMethod = getMainMethod(className, &vclass);
+	if (mainMethod == NULL)
+		return FT_ERR_NOTFOUND;
+
+	for (i = 0; i < numParams; i++) {
+		ret = callMain(vclass, mainMethod, params[i], &retType, &retVar);
+		if (ret != FT_ERR_OK || vmStatus.type == TYPE_FATAL_ERROR)
+			status[i] = BATCH_FAILED;
+		else if (retType == RET_TYPE_EXCEPTION)
+			status[i] = BATCH_EXCEPTION;
+		else
+			status[i] = BATCH_OK;
+
+		if (hook != NULL)
+			hook(i, status[i], arg);
+		if (status[i] == BATCH_FAILED)
+			return FT_ERR_FAILED;
+
+		VmStreamReset();
+		gc(GC_REASON_EXPLICIT);
+	}
+
+	return FT_ERR_OK;
+}
+
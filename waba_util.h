@@ -10,6 +10,18 @@ extern "C" {
 long callStaticMethod(WClass* wclass, UtfString name, UtfString desc, Var params[], unsigned short numParams, unsigned char *retType, Var* retVar);
 long startStaticMain(const char *className, const char *param, unsigned char *retType, Var* retVar);
 
+// status of each record of a batch
+#define BATCH_OK			0 // main returned
+#define BATCH_EXCEPTION		1 // main threw an exception
+#define BATCH_FAILED		(-1) // fatal error, the rest of the batch isn't run
+
+// called after each record of a batch, the host takes its output here.
+// The streams are emptied when it returns, the input of the next record
+// is pushed when it reads it (see StreamHook).
+typedef void (*BatchHook)(unsigned long index, long status, void *arg);
+
+long startStaticMainBatch(const char *className, const char *params[], unsigned long numParams, long status[], BatchHook hook, void *arg);
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus